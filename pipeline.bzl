@@ -4,6 +4,10 @@ def run_pipeline(config, max_xy_size):
         for mask in config[source_dem]['masks']:
             mask_name = mask['name']
             for decimation in mask['decimations']:
+                # Masks are still cut by dem_to_data --trim, not read as windows of one
+                # blob (hmm --window, hmply -w): --trim also drops all-NaN edge rows and
+                # columns, and --decimation subsamples where a window box filters, so
+                # switching would change the meshes of these targets.
                 trim_args = '--trim="{}"'.format(mask['bounds']) if 'bounds' in mask else ''
                 decimation_suffix = ("" if decimation == 1 else '_decimate{}'.format(decimation))
                 ident = mask_name + decimation_suffix
@@ -32,6 +36,8 @@ def run_pipeline(config, max_xy_size):
                     cmd ="$(location //src:data_to_png) $< $@ --target_dimension 2000 && du -hs $@",
                 )
 
+                make_tiled_heightmap_test(ident, data_name, mask['make_grid_mesh'])
+
                 if mask['make_grid_mesh']:
                     make_grid_mesh(ident, data_name, xscale, yscale)
 
@@ -47,6 +53,30 @@ def sanitize_name(name):
     return name
 
 
+def make_tiled_heightmap_test(ident, data_name, with_grid_mesh):
+    # Meshes of the tiled heightmap must be byte-identical to meshes of the data
+    # blob. Grid meshes only for the masks small enough to get one anyway.
+    data = [
+        data_name,
+        "//src:tile_heightmap",
+        "//src:hmm",
+    ]
+    args = [
+        "$(location //src:tile_heightmap)",
+        "$(location //src:hmm)",
+        "$(location {})".format(data_name),
+    ]
+    if with_grid_mesh:
+        data.append("//src:hmply")
+        args.append("$(location //src:hmply)")
+    native.sh_test(
+        name = "test_tiled_heightmap_{}".format(ident),
+        srcs = ["test_tiled_heightmap.sh"],
+        data = data,
+        args = args,
+    )
+
+
 def make_grid_mesh(ident, data_name, xscale, yscale):
     # Turn the data blob into a ply with hmply. but only for coarse decimation.
     native.genrule(
@@ -55,27 +85,72 @@ def make_grid_mesh(ident, data_name, xscale, yscale):
         srcs = [data_name],
         outs = ["grid_{}.ply".format(ident)],
         cmd = """
-time $(location //src:hmply) -i $< -b 0.25 -e 170 -x {xscale} -y {yscale}
->&2 du -hs header.dat vertices.dat triangles.dat
->&2 echo "\nconcatenating files"
-time cat header.dat vertices.dat triangles.dat > $@
-rm header.dat vertices.dat triangles.dat
+time $(location //src:hmply) -i $< -o $@ -b 0.25 -e 170 -x {xscale} -y {yscale}
 du -hs $@
 """.format(
     xscale=xscale,
     yscale=yscale,
 ),
     )
+    # A mosaic of overlapping tiles cut from the data blob must mesh like it,
+    # whole and through a window.
+    native.sh_test(
+        name = "test_heightmap_mosaic_{}".format(ident),
+        srcs = ["test_heightmap_mosaic.sh"],
+        data = [
+            data_name,
+            "//src:hmply",
+        ],
+        args = [
+            "$(location //src:hmply)",
+            "$(location {})".format(data_name),
+        ],
+    )
+    # Pyramid level 1 must mesh like a 2x decimated read, and stale pyramids
+    # must be rejected.
+    native.sh_test(
+        name = "test_heightmap_pyramid_{}".format(ident),
+        srcs = ["test_heightmap_pyramid.sh"],
+        data = [
+            data_name,
+            "//src:build_pyramid",
+            "//src:hmply",
+        ],
+        args = [
+            "$(location //src:build_pyramid)",
+            "$(location //src:hmply)",
+            "$(location {})".format(data_name),
+        ],
+    )
+    # The grid mesh must survive a trip through STL and back.
+    native.sh_test(
+        name = "test_roundtrip_stl_{}".format(ident),
+        srcs = ["test_roundtrip_stl.sh"],
+        data = [
+            "grid_{}.ply".format(ident),
+            "//src:ply2stl",
+            "//src:stl2ply",
+        ],
+        args = [
+            "$(location //src:ply2stl)",
+            "$(location //src:stl2ply)",
+            "$(location grid_{}.ply)".format(ident),
+        ],
+    )
+    # The STL is meshed straight from the data blob, a triangle at a time.
     native.genrule(
-        name = "grid_ply2stl_{}".format(ident),
-        tools = ["//src:ply2stl"],
-        srcs = ["grid_{}.ply".format(ident)],
+        name = "grid_stl_{}".format(ident),
+        tools = ["//src:hmply"],
+        srcs = [data_name],
         outs = ["grid_{}.stl".format(ident)],
         local=True,
         cmd = """
-$(location //src:ply2stl) $< $@
+time $(location //src:hmply) -i $< --stl $@ -b 0.25 -e 170 -x {xscale} -y {yscale}
 du -hs $@
-""",
+""".format(
+    xscale=xscale,
+    yscale=yscale,
+),
     )
 
 
@@ -0,0 +1,15 @@
+#include <iostream>
+#include <string>
+#include "src/common/heightmap_pyramid.hpp"
+
+// Usage: ./build_pyramid input.dat [min_size]
+// Writes input.dat.pyr.
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Need 1 or 2 arguments: input and optional smallest level size" << std::endl;
+    exit(1);
+  }
+  const std::string input_path = argv[1];
+  const int min_size = argc == 3 ? std::stoi(argv[2]) : 64;
+  BuildHeightmapPyramid(input_path, min_size);
+}
@@ -1,26 +1,324 @@
 #include "src/common/heightmap_data.hpp"
 
-#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void ReadHeightmapData(const std::string &path, int32_t *nx, int32_t *ny, std::vector<float> *image) {
-  std::ifstream image_file(path, std::ios::in|std::ios::binary);
-  if (!image_file.is_open()) {
+// The file is a (ny, nx) pair of int32 followed by nx*ny row-major float32 samples.
+static constexpr size_t kHeaderBytes = 8;
+
+static int AdviceFlag(const HeightmapView::Access access) {
+  switch (access) {
+  case HeightmapView::Access::kSequential:
+    return MADV_SEQUENTIAL;
+  case HeightmapView::Access::kRandom:
+    return MADV_RANDOM;
+  default:
+    return MADV_NORMAL;
+  }
+}
+
+HeightmapView::HeightmapView(const std::string &path, const Access access) :
+    HeightmapView(path, 0, PyramidPlane::kMean, access) {}
+
+HeightmapView::HeightmapView(const std::string &path, const uint32_t level, const PyramidPlane plane,
+                             const Access access) :
+    mapping_(nullptr),
+    mapping_size_(0),
+    width_(0),
+    height_(0),
+    data_(nullptr) {
+  if (level == 0) {
+    MapData(path);
+  } else {
+    MapPyramidLevel(path, level, plane);
+  }
+  Advise(access);
+}
+
+void HeightmapView::Map(const std::string &path, const size_t min_size) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
     fprintf(stderr, "Failed to open image.\n");
     std::exit(1);
   }
 
-  image_file.read(reinterpret_cast<char*>(ny), 4);
-  image_file.read(reinterpret_cast<char*>(nx), 4);
-  fprintf(stderr, "Reading (%d x %d) doubles...\n", *nx, *ny);
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < min_size) {
+    fprintf(stderr, "error: %s is too small to hold a heightmap header\n", path.c_str());
+    std::exit(1);
+  }
+  mapping_size_ = static_cast<size_t>(st.st_size);
+
+  mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping_ == MAP_FAILED) {
+    fprintf(stderr, "error: failed to mmap %s\n", path.c_str());
+    std::exit(1);
+  }
+}
+
+void HeightmapView::MapData(const std::string &path) {
+  Map(path, kHeaderBytes);
+
+  const char *bytes = static_cast<const char*>(mapping_);
+  memcpy(&height_, bytes, 4);
+  memcpy(&width_, bytes + 4, 4);
+  fprintf(stderr, "Reading (%d x %d) doubles...\n", width_, height_);
+
+  if (width_ < 0 || height_ < 0 || mapping_size_ - kHeaderBytes < 4 * Size()) {
+    fprintf(stderr, "error: only %lu bytes could be read of %s\n", mapping_size_ - kHeaderBytes, path.c_str());
+    std::exit(1);
+  }
+  data_ = reinterpret_cast<const float*>(bytes + kHeaderBytes);
+}
+
+// Exit unless the pyramid at pyramid_path was built from the heightmap at path as
+// it is now: same size, and not modified since.
+static void CheckPyramidIsCurrent(const std::string &path, const std::string &pyramid_path,
+                                  const HeightmapPyramidHeader &header) {
+  FILE *file = fopen(path.c_str(), "rb");
+  int32_t size[2];
+  if (file == NULL || fread(size, 4, 2, file) != 2) {
+    fprintf(stderr, "error: failed to read the header of %s, which %s was built from\n",
+            path.c_str(), pyramid_path.c_str());
+    std::exit(1);
+  }
+  fclose(file);
+  if (size[1] != header.base_width || size[0] != header.base_height) {
+    fprintf(stderr, "error: %s was built from a %d x %d heightmap but %s is %d x %d; rebuild it\n",
+            pyramid_path.c_str(), header.base_width, header.base_height, path.c_str(), size[1], size[0]);
+    std::exit(1);
+  }
+
+  struct stat data_stat;
+  struct stat pyramid_stat;
+  if (stat(path.c_str(), &data_stat) != 0 || stat(pyramid_path.c_str(), &pyramid_stat) != 0) {
+    fprintf(stderr, "error: failed to stat %s or %s\n", path.c_str(), pyramid_path.c_str());
+    std::exit(1);
+  }
+  const timespec &data_time = data_stat.st_mtim;
+  const timespec &pyramid_time = pyramid_stat.st_mtim;
+  if (pyramid_time.tv_sec < data_time.tv_sec ||
+      (pyramid_time.tv_sec == data_time.tv_sec && pyramid_time.tv_nsec < data_time.tv_nsec)) {
+    fprintf(stderr, "error: %s is older than %s; rebuild it\n", pyramid_path.c_str(), path.c_str());
+    std::exit(1);
+  }
+}
+
+void HeightmapView::MapPyramidLevel(const std::string &path, const uint32_t level, const PyramidPlane plane) {
+  const std::string pyramid_path = PyramidPath(path);
+  Map(pyramid_path, sizeof(HeightmapPyramidHeader));
+
+  const char *bytes = static_cast<const char*>(mapping_);
+  HeightmapPyramidHeader header;
+  memcpy(&header, bytes, sizeof(header));
+  if (memcmp(header.magic, kHeightmapPyramidMagic, 8) != 0 || header.version != kHeightmapPyramidVersion) {
+    fprintf(stderr, "error: %s is not a version %u heightmap pyramid\n", pyramid_path.c_str(), kHeightmapPyramidVersion);
+    std::exit(1);
+  }
+  if (level > header.num_levels) {
+    fprintf(stderr, "error: level %u requested but %s only has %u levels\n",
+            level, pyramid_path.c_str(), header.num_levels);
+    std::exit(1);
+  }
+  CheckPyramidIsCurrent(path, pyramid_path, header);
+
+  HeightmapPyramidLevel entry;
+  const uint64_t entry_offset = sizeof(header) + static_cast<uint64_t>(level - 1) * sizeof(entry);
+  if (entry_offset + sizeof(entry) > mapping_size_) {
+    fprintf(stderr, "error: the level table is truncated in %s\n", pyramid_path.c_str());
+    std::exit(1);
+  }
+  memcpy(&entry, bytes + entry_offset, sizeof(entry));
+  width_ = entry.width;
+  height_ = entry.height;
+  fprintf(stderr, "Reading (%d x %d) doubles from pyramid level %u (decimated by %u)...\n",
+          width_, height_, level, entry.factor);
+
+  const uint64_t plane_offset = entry.offset + static_cast<uint64_t>(plane) * 4 * Size();
+  if (plane_offset + 4 * Size() > mapping_size_) {
+    fprintf(stderr, "error: pyramid level %u is truncated in %s\n", level, pyramid_path.c_str());
+    std::exit(1);
+  }
+  data_ = reinterpret_cast<const float*>(bytes + plane_offset);
+}
+
+HeightmapView::~HeightmapView() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  }
+}
+
+void HeightmapView::Advise(const Access access) const {
+  // Advice is only a hint, so a failure here is not fatal.
+  (void)madvise(mapping_, mapping_size_, AdviceFlag(access));
+}
+
+HeightmapStream::HeightmapStream(const char *path) :
+    input_(stdin),
+    owns_input_(false),
+    width_(0),
+    height_(0),
+    next_row_(0) {
+  if (path != NULL) {
+    input_ = fopen(path, "rb");
+    owns_input_ = true;
+    if (input_ == NULL) {
+      fprintf(stderr, "Failed to open image.\n");
+      std::exit(1);
+    }
+  }
+
+  if (fread(&height_, 4, 1, input_) != 1 || fread(&width_, 4, 1, input_) != 1 || width_ < 0 || height_ < 0) {
+    fprintf(stderr, "error: failed to read heightmap header from %s\n", path == NULL ? "stdin" : path);
+    std::exit(1);
+  }
+  fprintf(stderr, "Streaming (%d x %d) doubles...\n", width_, height_);
+}
+
+HeightmapStream::~HeightmapStream() {
+  if (owns_input_) {
+    fclose(input_);
+  }
+}
+
+void HeightmapStream::ReadRows(float *dst, const uint32_t num_rows) {
+  if (next_row_ + num_rows > static_cast<uint32_t>(height_)) {
+    fprintf(stderr, "error: reading past the last heightmap row\n");
+    std::exit(1);
+  }
+  const size_t num_floats = static_cast<size_t>(num_rows) * static_cast<size_t>(width_);
+  if (fread(dst, 4, num_floats, input_) != num_floats) {
+    fprintf(stderr, "error: heightmap stream ended before row %u\n", next_row_ + num_rows);
+    std::exit(1);
+  }
+  next_row_ += num_rows;
+}
+
+bool HeightmapStream::Rewind() {
+  if (fseek(input_, static_cast<long>(kHeaderBytes), SEEK_SET) != 0) {
+    return false;
+  }
+  next_row_ = 0;
+  return true;
+}
+
+bool IsWholeHeightmap(const HeightmapWindow &window) {
+  return window.x0 <= 0 && window.y0 <= 0 && window.width <= 0 && window.height <= 0 && window.decimation <= 1;
+}
 
-  const size_t num_floats = static_cast<size_t>(*nx) * static_cast<size_t>(*ny);
-  image->resize(num_floats, 0);
-  image_file.read(reinterpret_cast<char*>(image->data()), 4*static_cast<int64_t>(num_floats));
+bool ParseHeightmapWindow(const char *text, HeightmapWindow *window) {
+  return sscanf(text, "%10d,%10d,%10d,%10d", &window->x0, &window->y0, &window->width, &window->height) == 4 &&
+         window->x0 >= 0 && window->y0 >= 0;
+}
 
-  if (!image_file) {
-    fprintf(stderr, "error: only %lu bytes could be read of %s\n", image_file.gcount(), path.c_str());
+bool ClampHeightmapWindow(const int32_t width, const int32_t height, const HeightmapWindow &window,
+                          int32_t *x0, int32_t *y0, int32_t *x1, int32_t *y1) {
+  *x0 = std::min(std::max(window.x0, 0), width);
+  *y0 = std::min(std::max(window.y0, 0), height);
+  *x1 = window.width > 0 ? std::min(*x0 + window.width, width) : width;
+  *y1 = window.height > 0 ? std::min(*y0 + window.height, height) : height;
+  if (*x0 >= *x1 || *y0 >= *y1) {
+    fprintf(stderr, "error: window (%d, %d, %d, %d) is outside the (%d x %d) heightmap\n",
+            window.x0, window.y0, window.width, window.height, width, height);
     std::exit(1);
   }
-  image_file.close();
+  return *x0 > 0 || *y0 > 0 || *x1 < width || *y1 < height;
+}
+
+void ReadHeightmapWindow(const int32_t width, const int32_t height, const HeightmapRowReader &read_row,
+                         const HeightmapWindow &window,
+                         int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  int32_t x0, y0, x1, y1;
+  const bool crop = ClampHeightmapWindow(width, height, window, &x0, &y0, &x1, &y1);
+  const int32_t decimation = std::max(window.decimation, 1);
+
+  *nx = (x1 - x0 + decimation - 1) / decimation;
+  *ny = (y1 - y0 + decimation - 1) / decimation;
+  fprintf(stderr, "Reading (%d x %d) window at (%d, %d), decimated by %d to (%d x %d)...\n",
+          x1 - x0, y1 - y0, x0, y0, decimation, *nx, *ny);
+
+  const size_t out_width = static_cast<size_t>(*nx);
+  image->resize(out_width * static_cast<size_t>(*ny));
+  std::vector<float> row(static_cast<size_t>(x1 - x0));
+  std::vector<double> sum(out_width);
+  std::vector<uint32_t> count(out_width);
+  float lowest = std::numeric_limits<float>::infinity();
+  for (int32_t oy = 0; oy < *ny; oy++) {
+    float *out = image->data() + static_cast<size_t>(oy) * out_width;
+    const int32_t block_y0 = y0 + oy * decimation;
+    const int32_t block_y1 = std::min(block_y0 + decimation, y1);
+
+    if (decimation == 1) {
+      read_row(block_y0, x0, x1, out);
+      for (size_t ox = 0; ox < out_width; ox++) {
+        lowest = std::min(lowest, out[ox]);
+      }
+      continue;
+    }
+
+    std::fill(sum.begin(), sum.end(), 0.0);
+    std::fill(count.begin(), count.end(), 0);
+    for (int32_t y = block_y0; y < block_y1; y++) {
+      read_row(y, x0, x1, row.data());
+      for (size_t x = 0; x < row.size(); x++) {
+        if (!std::isnan(row[x])) {
+          const size_t ox = x / static_cast<size_t>(decimation);
+          sum[ox] += static_cast<double>(row[x]);
+          count[ox]++;
+        }
+      }
+    }
+    for (size_t ox = 0; ox < out_width; ox++) {
+      out[ox] = count[ox] == 0 ? std::numeric_limits<float>::quiet_NaN()
+                               : static_cast<float>(sum[ox] / count[ox] / decimation);
+      lowest = std::min(lowest, out[ox]);
+    }
+  }
+
+  // std::min(lowest, NaN) keeps lowest, so it's infinite if every sample is masked
+  if (crop && std::isfinite(lowest)) {
+    for (float &z : *image) {
+      z -= lowest;
+    }
+  }
 }
 
+void ReadHeightmapWindow(const HeightmapView &view, const HeightmapWindow &window,
+                         int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  const auto read_row = [&view](const int32_t y, const int32_t x0, const int32_t x1, float *dst) {
+    const float *row = view.Row(static_cast<uint32_t>(y));
+    std::copy(row + x0, row + x1, dst);
+  };
+  ReadHeightmapWindow(view.Width(), view.Height(), read_row, window, nx, ny, image);
+}
+
+void ReadHeightmapData(const std::string &path, const HeightmapWindow &window,
+                       int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  // a window only touches some of each row, so don't read ahead
+  const HeightmapView view(path, HeightmapView::Access::kRandom);
+  ReadHeightmapWindow(view, window, nx, ny, image);
+}
+
+void ReadHeightmapData(const std::string &path, int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  const HeightmapView view(path, HeightmapView::Access::kSequential);
+  *nx = view.Width();
+  *ny = view.Height();
+  image->assign(view.Data(), view.Data() + view.Size());
+}
+
+void ReadHeightmapData(const std::string &path, const uint32_t level,
+                       int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  const HeightmapView view(path, level, PyramidPlane::kMean, HeightmapView::Access::kSequential);
+  *nx = view.Width();
+  *ny = view.Height();
+  image->assign(view.Data(), view.Data() + view.Size());
+}
@@ -1,8 +1,131 @@
 #pragma once
 
 #include <inttypes.h>
+#include <stdio.h>
 
+#include <functional>
 #include <vector>
 #include <string>
 
+#include "src/common/heightmap_pyramid.hpp"
+
+// Read-only, memory-mapped view of a heightmap data file.
+// The samples are used in place from the page cache rather than copied into a vector.
+class HeightmapView {
+public:
+  // Hint to the kernel about how the samples will be traversed.
+  enum class Access {
+    kSequential,
+    kRandom
+  };
+
+  HeightmapView(const std::string &path, const Access access);
+  // View of one plane of a pyramid level from the sidecar next to path.
+  // Level 0 is the heightmap itself.
+  HeightmapView(const std::string &path, const uint32_t level, const PyramidPlane plane, const Access access);
+  ~HeightmapView();
+
+  HeightmapView(const HeightmapView&) = delete;
+  HeightmapView& operator=(const HeightmapView&) = delete;
+
+  int32_t Width() const { return width_; }
+  int32_t Height() const { return height_; }
+  uint64_t Size() const { return static_cast<uint64_t>(width_) * static_cast<uint64_t>(height_); }
+
+  const float *Data() const { return data_; }
+  const float *Row(const uint32_t y) const { return data_ + static_cast<uint64_t>(y) * static_cast<uint64_t>(width_); }
+  float At(const uint32_t x, const uint32_t y) const { return Row(y)[x]; }
+
+  // Change the access hint, e.g. after a sequential scan is done.
+  void Advise(const Access access) const;
+
+private:
+  void Map(const std::string &path, const size_t min_size);
+  void MapData(const std::string &path);
+  void MapPyramidLevel(const std::string &path, const uint32_t level, const PyramidPlane plane);
+
+  void *mapping_;
+  size_t mapping_size_;
+  int32_t width_;
+  int32_t height_;
+  const float *data_;
+};
+
+// Sequential reader over a heightmap data file or stdin, a band of rows at a time.
+// Only the rows handed to ReadRows are ever resident.
+class HeightmapStream {
+public:
+  // Reads from stdin if path is NULL.
+  explicit HeightmapStream(const char *path);
+  ~HeightmapStream();
+
+  HeightmapStream(const HeightmapStream&) = delete;
+  HeightmapStream& operator=(const HeightmapStream&) = delete;
+
+  int32_t Width() const { return width_; }
+  int32_t Height() const { return height_; }
+  uint64_t Size() const { return static_cast<uint64_t>(width_) * static_cast<uint64_t>(height_); }
+
+  // Read the next num_rows rows into dst, which must hold num_rows * Width() floats.
+  void ReadRows(float *dst, const uint32_t num_rows);
+
+  // Seek back to the first row. Returns false if the input can't seek (e.g. a pipe).
+  bool Rewind();
+
+private:
+  FILE *input_;
+  bool owns_input_;
+  int32_t width_;
+  int32_t height_;
+  uint32_t next_row_;
+};
+
+// Pixel window [x0, x0 + width) x [y0, y0 + height) of a heightmap (x is the column),
+// box filtered down by an integer decimation factor.
+// A non-positive width or height extends the window to the edge of the heightmap.
+struct HeightmapWindow {
+  int32_t x0;
+  int32_t y0;
+  int32_t width;
+  int32_t height;
+  int32_t decimation;
+};
+
+// The whole heightmap at full resolution.
+static constexpr HeightmapWindow kWholeHeightmap = {0, 0, 0, 0, 1};
+
+bool IsWholeHeightmap(const HeightmapWindow &window);
+
+// Parse "X0,Y0,WIDTH,HEIGHT" into window, returning false if it's malformed.
+bool ParseHeightmapWindow(const char *text, HeightmapWindow *window);
+
+// Pixel bounds [x0, x1) x [y0, y1) of window in a width x height heightmap,
+// exiting if the window is outside it. Returns true if the window crops the
+// heightmap, rather than covering all of it.
+bool ClampHeightmapWindow(const int32_t width, const int32_t height, const HeightmapWindow &window,
+                          int32_t *x0, int32_t *y0, int32_t *x1, int32_t *y1);
+
+// Copy a window out of a mapped heightmap. Each output pixel is the mean of the
+// non-NaN samples in its decimation x decimation block (NaN if there are none),
+// divided by the decimation factor like dem_to_data --decimation.
+// A window that crops the heightmap is shifted so its lowest non-NaN sample is
+// 0, as dem_to_data --trim normalizes each mask; a window of the whole
+// heightmap keeps its heights, like the pyramid levels.
+// Only the rows and columns inside the window are touched.
+void ReadHeightmapWindow(const HeightmapView &view, const HeightmapWindow &window,
+                         int32_t *nx, int32_t *ny, std::vector<float> *image);
+
+// Copies columns [x0, x1) of row y into dst.
+using HeightmapRowReader = std::function<void(int32_t y, int32_t x0, int32_t x1, float *dst)>;
+
+// Same, for a width x height raster that isn't a single mapped file.
+void ReadHeightmapWindow(const int32_t width, const int32_t height, const HeightmapRowReader &read_row,
+                         const HeightmapWindow &window,
+                         int32_t *nx, int32_t *ny, std::vector<float> *image);
+
 void ReadHeightmapData(const std::string &path, int32_t *nx, int32_t *ny, std::vector<float> *image);
+void ReadHeightmapData(const std::string &path, const HeightmapWindow &window,
+                       int32_t *nx, int32_t *ny, std::vector<float> *image);
+// Read the mean plane of a pyramid level (see heightmap_pyramid.hpp).
+void ReadHeightmapData(const std::string &path, const uint32_t level,
+                       int32_t *nx, int32_t *ny, std::vector<float> *image);
@@ -0,0 +1,142 @@
+#include "src/common/heightmap_mosaic.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+static constexpr char kMosaicMagic[] = "heightmap_mosaic";
+static constexpr int kMosaicVersion = 1;
+
+bool IsHeightmapMosaic(const std::string &path) {
+  std::ifstream input(path);
+  std::string magic;
+  return static_cast<bool>(input >> magic) && magic == kMosaicMagic;
+}
+
+HeightmapMosaic::HeightmapMosaic(const std::string &manifest_path) :
+    width_(0),
+    height_(0) {
+  std::ifstream manifest(manifest_path);
+  if (!manifest.is_open()) {
+    fprintf(stderr, "Failed to open mosaic manifest %s\n", manifest_path.c_str());
+    std::exit(1);
+  }
+
+  std::string line;
+  std::string magic;
+  int version = 0;
+  if (!std::getline(manifest, line) || !(std::istringstream(line) >> magic >> version) ||
+      magic != kMosaicMagic || version != kMosaicVersion) {
+    fprintf(stderr, "error: %s is not a version %d heightmap mosaic\n", manifest_path.c_str(), kMosaicVersion);
+    std::exit(1);
+  }
+
+  const size_t slash = manifest_path.find_last_of('/');
+  const std::string directory = slash == std::string::npos ? "" : manifest_path.substr(0, slash + 1);
+
+  int line_number = 1;
+  while (std::getline(manifest, line)) {
+    line_number++;
+    std::istringstream fields(line);
+    std::string path;
+    if (!(fields >> path) || path[0] == '#') {
+      continue;
+    }
+    Tile tile;
+    if (!(fields >> tile.x0 >> tile.y0) || tile.x0 < 0 || tile.y0 < 0) {
+      fprintf(stderr, "error: %s:%d: expected \"path x0 y0\" with non-negative x0 and y0\n",
+              manifest_path.c_str(), line_number);
+      std::exit(1);
+    }
+    tile.path = path[0] == '/' ? path : directory + path;
+
+    // Only the header is read now; the samples are mapped on first use.
+    FILE *input = fopen(tile.path.c_str(), "rb");
+    if (input == NULL ||
+        fread(&tile.height, 4, 1, input) != 1 ||
+        fread(&tile.width, 4, 1, input) != 1 ||
+        tile.width < 0 || tile.height < 0) {
+      fprintf(stderr, "error: failed to read heightmap header from %s\n", tile.path.c_str());
+      std::exit(1);
+    }
+    fclose(input);
+
+    width_ = std::max(width_, tile.x0 + tile.width);
+    height_ = std::max(height_, tile.y0 + tile.height);
+    tiles_.push_back(std::move(tile));
+  }
+
+  fprintf(stderr, "Mosaic of %zu tiles, (%d x %d)\n", tiles_.size(), width_, height_);
+}
+
+const HeightmapView &HeightmapMosaic::View(Tile *tile) {
+  if (!tile->view) {
+    tile->view = std::make_unique<HeightmapView>(tile->path, HeightmapView::Access::kSequential);
+    if (tile->view->Width() != tile->width || tile->view->Height() != tile->height) {
+      fprintf(stderr, "error: %s changed size since the mosaic was opened\n", tile->path.c_str());
+      std::exit(1);
+    }
+  }
+  return *tile->view;
+}
+
+void HeightmapMosaic::ReadRow(const int32_t y, const int32_t x0, const int32_t x1, float *dst) {
+  std::fill(dst, dst + (x1 - x0), std::numeric_limits<float>::quiet_NaN());
+  for (Tile &tile : tiles_) {
+    if (y < tile.y0 || y >= tile.y0 + tile.height) {
+      continue;
+    }
+    const int32_t begin = std::max(x0, tile.x0);
+    const int32_t end = std::min(x1, tile.x0 + tile.width);
+    if (begin >= end) {
+      continue;
+    }
+    const float *row = View(&tile).Row(static_cast<uint32_t>(y - tile.y0));
+    std::copy(row + (begin - tile.x0), row + (end - tile.x0), dst + (begin - x0));
+  }
+}
+
+void HeightmapMosaic::ReadRows(const uint32_t y0, const uint32_t num_rows, float *dst) {
+  for (uint32_t r = 0; r < num_rows; r++) {
+    ReadRow(static_cast<int32_t>(y0 + r), 0, width_, dst + static_cast<uint64_t>(r) * static_cast<uint64_t>(width_));
+  }
+}
+
+void HeightmapMosaic::ReadWindow(const HeightmapWindow &window,
+                                 int32_t *nx, int32_t *ny, std::vector<float> *image) {
+  const auto read_row = [this](const int32_t y, const int32_t x0, const int32_t x1, float *dst) {
+    ReadRow(y, x0, x1, dst);
+  };
+  ReadHeightmapWindow(width_, height_, read_row, window, nx, ny, image);
+  fprintf(stderr, "Mapped %zu of %zu mosaic tiles\n", NumMapped(), tiles_.size());
+}
+
+void HeightmapMosaic::Range(float *min, float *max) {
+  *min = std::numeric_limits<float>::max();
+  *max = std::numeric_limits<float>::lowest();
+  for (Tile &tile : tiles_) {
+    const HeightmapView &view = View(&tile);
+    const float *data = view.Data();
+    for (uint64_t k = 0; k < view.Size(); k++) {
+      if (!std::isnan(data[k])) {
+        *min = std::min(*min, data[k]);
+        *max = std::max(*max, data[k]);
+      }
+    }
+  }
+}
+
+size_t HeightmapMosaic::NumMapped() const {
+  size_t mapped = 0;
+  for (const Tile &tile : tiles_) {
+    if (tile.view) {
+      mapped++;
+    }
+  }
+  return mapped;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/common/heightmap_data.hpp"
+
+// Many heightmap data files presented as one raster, without merging them.
+//
+// The manifest is a text file:
+//
+//   heightmap_mosaic 1
+//   # path x0 y0
+//   tile_a.dat 0 0
+//   tile_b.dat 4000 0
+//
+// Paths are relative to the manifest. Each tile is placed with its first sample
+// at pixel (x0, y0) of the mosaic, which spans the bounding box of all tiles from
+// (0, 0). Where tiles overlap the later one wins, and pixels no tile covers are NaN.
+// Tiles are only mapped once a read touches them.
+class HeightmapMosaic {
+public:
+  explicit HeightmapMosaic(const std::string &manifest_path);
+
+  HeightmapMosaic(const HeightmapMosaic&) = delete;
+  HeightmapMosaic& operator=(const HeightmapMosaic&) = delete;
+
+  int32_t Width() const { return width_; }
+  int32_t Height() const { return height_; }
+  uint64_t Size() const { return static_cast<uint64_t>(width_) * static_cast<uint64_t>(height_); }
+
+  // Copy columns [x0, x1) of row y into dst.
+  void ReadRow(const int32_t y, const int32_t x0, const int32_t x1, float *dst);
+
+  // Copy whole rows [y0, y0 + num_rows) into dst, which must hold num_rows * Width() floats.
+  void ReadRows(const uint32_t y0, const uint32_t num_rows, float *dst);
+
+  // Windowed, box-filtered read, see ReadHeightmapWindow.
+  void ReadWindow(const HeightmapWindow &window, int32_t *nx, int32_t *ny, std::vector<float> *image);
+
+  // Range of the non-NaN samples of every tile. This maps all of them.
+  void Range(float *min, float *max);
+
+  // Number of tiles mapped so far.
+  size_t NumMapped() const;
+
+private:
+  struct Tile {
+    std::string path;
+    int32_t x0;
+    int32_t y0;
+    int32_t width;
+    int32_t height;
+    std::unique_ptr<HeightmapView> view;
+  };
+
+  const HeightmapView &View(Tile *tile);
+
+  std::vector<Tile> tiles_;
+  int32_t width_;
+  int32_t height_;
+};
+
+// True if the file at path is a mosaic manifest.
+bool IsHeightmapMosaic(const std::string &path);
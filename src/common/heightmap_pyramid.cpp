@@ -0,0 +1,160 @@
+#include "src/common/heightmap_pyramid.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "src/common/heightmap_data.hpp"
+
+std::string PyramidPath(const std::string &heightmap_path) {
+  return heightmap_path + ".pyr";
+}
+
+namespace {
+
+// One level while building, in the heightmap's own units.
+struct Level {
+  int32_t width;
+  int32_t height;
+  std::vector<double> sum;
+  std::vector<uint32_t> count;
+  std::vector<float> min;
+  std::vector<float> max;
+
+  uint32_t Count(const uint64_t i) const { return count[i]; }
+  double Sum(const uint64_t i) const { return sum[i]; }
+  float Min(const uint64_t i) const { return min[i]; }
+  float Max(const uint64_t i) const { return max[i]; }
+};
+
+// The heightmap itself, read in place so level 0 is never copied.
+struct BaseLevel {
+  explicit BaseLevel(const HeightmapView &view) :
+      width(view.Width()), height(view.Height()), data(view.Data()) {}
+
+  int32_t width;
+  int32_t height;
+  const float *data;
+
+  uint32_t Count(const uint64_t i) const { return std::isnan(data[i]) ? 0 : 1; }
+  double Sum(const uint64_t i) const { return static_cast<double>(data[i]); }
+  float Min(const uint64_t i) const { return data[i]; }
+  float Max(const uint64_t i) const { return data[i]; }
+};
+
+template <class Fine>
+Level Reduce(const Fine &fine) {
+  Level coarse;
+  coarse.width = (fine.width + 1) / 2;
+  coarse.height = (fine.height + 1) / 2;
+  const uint64_t size = static_cast<uint64_t>(coarse.width) * static_cast<uint64_t>(coarse.height);
+  coarse.sum.assign(size, 0.0);
+  coarse.count.assign(size, 0);
+  coarse.min.assign(size, std::numeric_limits<float>::quiet_NaN());
+  coarse.max.assign(size, std::numeric_limits<float>::quiet_NaN());
+
+  for (int32_t y = 0; y < fine.height; y++) {
+    const uint64_t fine_row = static_cast<uint64_t>(y) * static_cast<uint64_t>(fine.width);
+    const uint64_t coarse_row = static_cast<uint64_t>(y / 2) * static_cast<uint64_t>(coarse.width);
+    for (int32_t x = 0; x < fine.width; x++) {
+      const uint64_t i = fine_row + static_cast<uint64_t>(x);
+      if (fine.Count(i) == 0) {
+        continue;
+      }
+      const uint64_t j = coarse_row + static_cast<uint64_t>(x / 2);
+      coarse.sum[j] += fine.Sum(i);
+      coarse.count[j] += fine.Count(i);
+      // NaN compares false, so the first valid sample always replaces it
+      if (!(coarse.min[j] <= fine.Min(i))) {
+        coarse.min[j] = fine.Min(i);
+      }
+      if (!(coarse.max[j] >= fine.Max(i))) {
+        coarse.max[j] = fine.Max(i);
+      }
+    }
+  }
+  return coarse;
+}
+
+void WritePlane(FILE *output, const std::vector<float> &plane) {
+  if (fwrite(plane.data(), sizeof(float), plane.size(), output) != plane.size()) {
+    fprintf(stderr, "Error writing pyramid plane\n");
+    std::exit(1);
+  }
+}
+
+}  // namespace
+
+void BuildHeightmapPyramid(const std::string &path, const int32_t min_size) {
+  const HeightmapView view(path, HeightmapView::Access::kSequential);
+
+  // count levels
+  std::vector<HeightmapPyramidLevel> table;
+  int32_t width = view.Width();
+  int32_t height = view.Height();
+  uint32_t factor = 1;
+  while (std::max(width, height) > std::max(min_size, 1)) {
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+    factor *= 2;
+    HeightmapPyramidLevel entry{};
+    entry.width = width;
+    entry.height = height;
+    entry.factor = factor;
+    table.push_back(entry);
+  }
+
+  uint64_t offset = sizeof(HeightmapPyramidHeader) + table.size() * sizeof(HeightmapPyramidLevel);
+  for (HeightmapPyramidLevel &entry : table) {
+    entry.offset = offset;
+    offset += 3 * sizeof(float) * static_cast<uint64_t>(entry.width) * static_cast<uint64_t>(entry.height);
+  }
+
+  HeightmapPyramidHeader header{};
+  memcpy(header.magic, kHeightmapPyramidMagic, 8);
+  header.version = kHeightmapPyramidVersion;
+  header.num_levels = static_cast<uint32_t>(table.size());
+  header.base_width = view.Width();
+  header.base_height = view.Height();
+
+  const std::string output_path = PyramidPath(path);
+  FILE *output = fopen(output_path.c_str(), "wb");
+  if (output == NULL) {
+    fprintf(stderr, "Error opening output file %s.\n", output_path.c_str());
+    std::exit(1);
+  }
+  if (fwrite(&header, sizeof(header), 1, output) != 1 ||
+      fwrite(table.data(), sizeof(HeightmapPyramidLevel), table.size(), output) != table.size()) {
+    fprintf(stderr, "Error writing pyramid header\n");
+    std::exit(1);
+  }
+
+  Level level;
+  for (const HeightmapPyramidLevel &entry : table) {
+    level = entry.factor == 2 ? Reduce(BaseLevel(view)) : Reduce(level);
+    const float scale = 1.0f / static_cast<float>(entry.factor);
+
+    std::vector<float> plane(level.sum.size());
+    for (uint64_t k = 0; k < plane.size(); k++) {
+      plane[k] = level.count[k] == 0 ? std::numeric_limits<float>::quiet_NaN()
+                                     : static_cast<float>(level.sum[k] / level.count[k]) * scale;
+    }
+    WritePlane(output, plane);
+    for (uint64_t k = 0; k < plane.size(); k++) {
+      plane[k] = level.min[k] * scale;
+    }
+    WritePlane(output, plane);
+    for (uint64_t k = 0; k < plane.size(); k++) {
+      plane[k] = level.max[k] * scale;
+    }
+    WritePlane(output, plane);
+
+    fprintf(stderr, "level %zu: (%d x %d), decimated by %u\n",
+            static_cast<size_t>(&entry - table.data()) + 1, entry.width, entry.height, entry.factor);
+  }
+  fclose(output);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <string>
+
+// Multi-resolution sidecar for a heightmap data file, stored next to it as <path>.pyr.
+//
+// Level k (k >= 1) halves level k-1 in each dimension (rounding up), so it is
+// decimated by 2^k. Every level stores three row-major float32 planes, in order:
+// mean, min and max over the non-NaN samples of the block it covers (NaN if the
+// block is entirely masked). Like dem_to_data --decimation, heights are divided
+// by the decimation factor so meshes of any level keep their proportions.
+//
+// Layout (little endian):
+//   HeightmapPyramidHeader
+//   HeightmapPyramidLevel[num_levels]   (levels 1 .. num_levels)
+//   planes
+
+static constexpr char kHeightmapPyramidMagic[8] = {'H', 'M', 'P', 'Y', 'R', 'A', 'M', '\0'};
+static constexpr uint32_t kHeightmapPyramidVersion = 1;
+
+struct HeightmapPyramidHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_levels;
+  // dimensions of level 0, the heightmap itself
+  int32_t base_width;
+  int32_t base_height;
+};
+static_assert(sizeof(HeightmapPyramidHeader) == 24);
+
+struct HeightmapPyramidLevel {
+  int32_t width;
+  int32_t height;
+  uint32_t factor;
+  uint32_t reserved;
+  // file position of the mean plane; min and max follow it
+  uint64_t offset;
+};
+static_assert(sizeof(HeightmapPyramidLevel) == 24);
+
+enum class PyramidPlane {
+  kMean = 0,
+  kMin = 1,
+  kMax = 2
+};
+
+std::string PyramidPath(const std::string &heightmap_path);
+
+// Build the sidecar for the heightmap at path, down to a level no larger than min_size pixels across.
+void BuildHeightmapPyramid(const std::string &path, const int32_t min_size);
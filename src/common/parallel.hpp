@@ -0,0 +1,38 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Number of worker threads to use for bulk work.
+inline uint32_t NumWorkers() {
+  const uint32_t hardware = std::thread::hardware_concurrency();
+  return hardware == 0 ? 1 : hardware;
+}
+
+// Split [0, count) into at most NumWorkers() contiguous chunks of at least
+// min_chunk items and call fn(begin, end) for each, in parallel.
+// Returns once every chunk is done.
+template <typename Fn>
+void ParallelFor(const uint64_t count, const uint64_t min_chunk, const Fn &fn) {
+  const uint64_t max_chunks = std::max<uint64_t>(count / std::max<uint64_t>(min_chunk, 1), 1);
+  const uint64_t num_chunks = std::min<uint64_t>(NumWorkers(), max_chunks);
+  if (num_chunks <= 1) {
+    fn(uint64_t{0}, count);
+    return;
+  }
+  const uint64_t chunk = (count + num_chunks - 1) / num_chunks;
+  std::vector<std::thread> workers;
+  workers.reserve(num_chunks - 1);
+  for (uint64_t begin = chunk; begin < count; begin += chunk) {
+    const uint64_t end = std::min(begin + chunk, count);
+    workers.emplace_back([&fn, begin, end]() { fn(begin, end); });
+  }
+  // the calling thread takes the first chunk
+  fn(uint64_t{0}, std::min(chunk, count));
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
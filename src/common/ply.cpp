@@ -1,50 +1,136 @@
 #include "ply.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-void WritePlyHeader(FILE * const output, const uint32_t vertex_count, const uint32_t triangle_count) {
-  fprintf(output, "ply\r\n");
-  fprintf(output, "format binary_little_endian 1.0\r\n");
-  fprintf(output, "element vertex %u\r\n", vertex_count);
-  fprintf(output, "property float x\r\n");
-  fprintf(output, "property float y\r\n");
-  fprintf(output, "property float z\r\n");
-  fprintf(output, "element face %u\r\n", triangle_count);
-  fprintf(output, "property list uchar uint vertex_indices\r\n");
-  fprintf(output, "end_header\r\n");
-}
-
-void ReadPlyHeader(FILE * const input, uint32_t *vertex_count, uint32_t *triangle_count) {
-  char buffer[81];
-  int lol = 0;
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-  //fprintf(output, "ply\r\n");
-  lol = fscanf(input, "%80s\n", buffer);
+#include "src/common/parallel.hpp"
 
-  //fprintf(output, "format binary_little_endian 1.0\r\n");
-  lol = fscanf(input, "%80s %80s %80s\n", buffer, buffer, buffer);
+// The header WritePlyHeader writes, padded with a comment so the vertices are
+// aligned for PlyView.
+static std::string PlyHeaderString(const uint32_t vertex_count, const uint32_t triangle_count) {
+  char header[512];
+  int length = snprintf(header, sizeof(header),
+                        "ply\r\n"
+                        "format binary_little_endian 1.0\r\n"
+                        "element vertex %u\r\n"
+                        "property float x\r\n"
+                        "property float y\r\n"
+                        "property float z\r\n"
+                        "element face %u\r\n"
+                        "property list uchar uint vertex_indices\r\n",
+                        vertex_count, triangle_count);
+  const char end[] = "end_header\r\n";
+  const int end_length = (int)sizeof(end) - 1;
+  if ((length + end_length) % 4 != 0) {
+    const int comment_length = 9;  // "comment\r\n"
+    const int spaces = (4 - (length + comment_length + end_length) % 4) % 4;
+    length += snprintf(header + length, sizeof(header) - (size_t)length, "comment%*s\r\n", spaces, "");
+  }
+  length += snprintf(header + length, sizeof(header) - (size_t)length, "%s", end);
+  return std::string(header, (size_t)length);
+}
 
-  //fprintf(output, "element vertex %u\r\n", vertex_count);
-  lol = fscanf(input, "%s %s %u\n", buffer, buffer, vertex_count);
+void WritePlyHeader(FILE * const output, const uint32_t vertex_count, const uint32_t triangle_count) {
+  const std::string header = PlyHeaderString(vertex_count, triangle_count);
+  if (fwrite(header.data(), 1, header.size(), output) != header.size()) {
+    fprintf(stderr, "Error writing PLY header\n");
+    std::exit(1);
+  }
+}
 
-  //fprintf(output, "property float x\r\n");
-  //fprintf(output, "property float y\r\n");
-  //fprintf(output, "property float z\r\n");
-  for (int k=0; k<3; k++) {
-    lol = fscanf(input, "%s %s %s\n", buffer, buffer, buffer);
+static bool ParsePlyType(const std::string &name, PlyType *type) {
+  static const struct {
+    const char *name;
+    PlyType type;
+  } kTypes[] = {
+    {"char", PlyType::kInt8}, {"int8", PlyType::kInt8},
+    {"uchar", PlyType::kUint8}, {"uint8", PlyType::kUint8},
+    {"short", PlyType::kInt16}, {"int16", PlyType::kInt16},
+    {"ushort", PlyType::kUint16}, {"uint16", PlyType::kUint16},
+    {"int", PlyType::kInt32}, {"int32", PlyType::kInt32},
+    {"uint", PlyType::kUint32}, {"uint32", PlyType::kUint32},
+    {"float", PlyType::kFloat32}, {"float32", PlyType::kFloat32},
+    {"double", PlyType::kFloat64}, {"float64", PlyType::kFloat64},
+  };
+  for (const auto &entry : kTypes) {
+    if (name == entry.name) {
+      *type = entry.type;
+      return true;
+    }
   }
+  return false;
+}
 
-  //fprintf(output, "element face %u\r\n", triangle_count);
-  lol = fscanf(input, "%80s %80s %u\n", buffer, buffer, triangle_count);
+PlyHeader ReadPlyHeader(FILE * const input) {
+  PlyHeader header;
+  char buffer[1024];
+  int line_number = 0;
+  bool ended = false;
+  while (!ended && fgets(buffer, sizeof(buffer), input) != NULL) {
+    line_number++;
+    std::istringstream line(buffer);
+    std::string keyword;
+    line >> keyword;
 
-  //fprintf(output, "property list uchar uint vertex_indices\r\n");
-  lol = fscanf(input, "%80s %80s %80s %80s %80s\n", buffer, buffer, buffer, buffer, buffer);
+    bool ok = true;
+    if (line_number == 1) {
+      ok = keyword == "ply";
+    } else if (keyword == "format") {
+      std::string format, version;
+      ok = static_cast<bool>(line >> format >> version);
+      if (ok && format != "binary_little_endian") {
+        fprintf(stderr, "Error: PLY format %s is not supported, only binary_little_endian\n", format.c_str());
+        std::exit(1);
+      }
+    } else if (keyword == "comment" || keyword == "obj_info") {
+      // ignored
+    } else if (keyword == "element") {
+      PlyElement element;
+      ok = static_cast<bool>(line >> element.name >> element.count);
+      header.elements.push_back(element);
+    } else if (keyword == "property") {
+      PlyProperty property{};
+      std::string type;
+      ok = !header.elements.empty() && static_cast<bool>(line >> type);
+      if (ok && type == "list") {
+        std::string count_type;
+        property.is_list = true;
+        ok = static_cast<bool>(line >> count_type >> type) && ParsePlyType(count_type, &property.count_type);
+      }
+      ok = ok && ParsePlyType(type, &property.type) && static_cast<bool>(line >> property.name);
+      if (ok) {
+        header.elements.back().properties.push_back(property);
+      }
+    } else if (keyword == "end_header") {
+      ended = true;
+    } else {
+      ok = false;
+    }
 
-  //fprintf(output, "end_header\r\n");
-  lol = fscanf(input, "%80s\n", buffer);
+    if (!ok) {
+      fprintf(stderr, "Error parsing PLY header line %d: %s\n", line_number, buffer);
+      std::exit(1);
+    }
+  }
+  if (!ended) {
+    fprintf(stderr, "Error: PLY header has no end_header\n");
+    std::exit(1);
+  }
 
-  (void)lol;
+  header.size = static_cast<uint64_t>(ftell(input));
+  return header;
 }
 
 void WriteTriangleHeader(FILE * const output) {
@@ -56,19 +142,6 @@ void WriteTriangleHeader(FILE * const output) {
   }
 }
 
-void ReadTriangleHeader(FILE * const input) {
-  // Write triangle header.
-  uint8_t three = 0; // This triangle will have three vertices, big surprise.
-  if (fread(&three, 1, 1, input) != 1) {
-    fprintf(stderr, "Error reading 'three' as uint8_t\n");
-    std::exit(1);
-  }
-  if (three != 3) {
-    fprintf(stderr, "Error reading 'three' in triangle header. It is not 3 it is %d\n", (int32_t)three);
-    std::exit(1);
-  }
-}
-
 void WriteVertex(FILE * const output, const glm::vec3 &vertex) {
   static_assert(sizeof(glm::vec3) == 3*sizeof(float));
   // Write this new vertex to file.
@@ -78,15 +151,6 @@ void WriteVertex(FILE * const output, const glm::vec3 &vertex) {
   }
 }
 
-void ReadVertex(FILE * const input, glm::vec3 *vertex) {
-  static_assert(sizeof(glm::vec3) == 3*sizeof(float));
-  if (fread(vertex, 4, 3, input) != 3) {
-    fprintf(stderr, "Error reading vertex\n");
-    std::exit(1);
-  }
-}
-
-
 void WriteVertexIndex(FILE * const output, const uint32_t vertex_index) {
   static_assert(sizeof(vertex_index) == 4);
   // write the vertex index to the triangle file
@@ -96,76 +160,298 @@ void WriteVertexIndex(FILE * const output, const uint32_t vertex_index) {
   }
 }
 
-void ReadVertexIndex(FILE * const input, uint32_t *vertex_index) {
-  static_assert(sizeof(*vertex_index) == 4);
-  // write the vertex index to the triangle file
-  if (fread(vertex_index, 4, 1, input) != 1) {
-    fprintf(stderr, "Error reading vertex indexu\n");
-    std::exit(1);
+PlyWriter::PlyWriter(const std::string &path, const uint32_t vertex_count, const uint32_t triangle_count) :
+    path_(path),
+    fd_(-1),
+    mapping_(MAP_FAILED),
+    mapping_size_(0),
+    vertices_(NULL),
+    faces_(NULL) {
+  const std::string header = PlyHeaderString(vertex_count, triangle_count);
+  mapping_size_ = header.size() + sizeof(glm::vec3) * vertex_count + kPlyFaceSize * triangle_count;
+
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0) {
+    fprintf(stderr, "Error opening output file %s.\n", path.c_str());
+    exit(1);
+  }
+  if (ftruncate(fd_, (off_t)mapping_size_) != 0) {
+    fprintf(stderr, "Error sizing output file %s to %" PRIu64 " bytes.\n", path.c_str(), mapping_size_);
+    exit(1);
+  }
+  mapping_ = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (mapping_ == MAP_FAILED) {
+    fprintf(stderr, "error: failed to mmap %s\n", path.c_str());
+    exit(1);
+  }
+
+  uint8_t *bytes = static_cast<uint8_t*>(mapping_);
+  memcpy(bytes, header.data(), header.size());
+  vertices_ = reinterpret_cast<glm::vec3*>(bytes + header.size());
+  faces_ = bytes + header.size() + sizeof(glm::vec3) * vertex_count;
+}
+
+PlyWriter::~PlyWriter() {
+  Close();
+}
+
+void PlyWriter::Close() {
+  if (mapping_ != MAP_FAILED) {
+    if (munmap(mapping_, mapping_size_) != 0) {
+      fprintf(stderr, "Error unmapping output file %s.\n", path_.c_str());
+      exit(1);
+    }
+    mapping_ = MAP_FAILED;
+  }
+  if (fd_ >= 0) {
+    if (close(fd_) != 0) {
+      fprintf(stderr, "Error closing output file %s.\n", path_.c_str());
+      exit(1);
+    }
+    fd_ = -1;
   }
 }
 
 void SavePly(const std::string &path,
              const std::vector<glm::vec3> &points,
              const std::vector<glm::ivec3> &triangles) {
-  FILE *output = fopen(path.c_str(), "w");
-  if (output == NULL) {
-    fprintf(stderr, "Error opening output file %s.\n", path.c_str());
-    exit(1);
+  PlyWriter writer(path, (uint32_t)points.size(), (uint32_t)triangles.size());
+
+  static_assert(sizeof(glm::vec3) == 3*sizeof(float));
+  glm::vec3 *vertices = writer.Vertices();
+  ParallelFor(points.size(), 1 << 16, [&](const uint64_t begin, const uint64_t end) {
+    memcpy(vertices + begin, points.data() + begin, sizeof(glm::vec3) * (end - begin));
+  });
+  ParallelFor(triangles.size(), 1 << 16, [&](const uint64_t begin, const uint64_t end) {
+    for (uint64_t k = begin; k < end; k++) {
+      writer.SetTriangle(k, triangles[k]);
+    }
+  });
+
+  writer.Close();
+}
+
+// Check that the file is the mesh layout SavePly writes: float x, y, z vertices
+// and faces with a uchar count and 32-bit indices.
+static void CheckMeshLayout(const std::string &path, const PlyHeader &header) {
+  bool ok = header.elements.size() == 2;
+  if (ok) {
+    const PlyElement &vertex = header.elements[0];
+    ok = vertex.name == "vertex" && vertex.properties.size() == 3;
+    const char *xyz[] = {"x", "y", "z"};
+    for (size_t k = 0; ok && k < 3; k++) {
+      ok = vertex.properties[k].name == xyz[k] &&
+           !vertex.properties[k].is_list &&
+           vertex.properties[k].type == PlyType::kFloat32;
+    }
+  }
+  if (ok) {
+    const PlyElement &face = header.elements[1];
+    ok = face.name == "face" && face.properties.size() == 1 &&
+         face.properties[0].is_list &&
+         face.properties[0].count_type == PlyType::kUint8 &&
+         (face.properties[0].type == PlyType::kInt32 || face.properties[0].type == PlyType::kUint32);
+  }
+  if (!ok) {
+    fprintf(stderr, "Error: %s is not a triangle mesh with float x, y, z vertices and "
+            "uchar-counted 32-bit face indices\n", path.c_str());
+    std::exit(1);
   }
+  if (header.elements[0].count > UINT32_MAX || header.elements[1].count > UINT32_MAX) {
+    fprintf(stderr, "Error: %s has more than 2^32 vertices or faces\n", path.c_str());
+    std::exit(1);
+  }
+}
 
-  WritePlyHeader(output, (uint32_t)points.size(), (uint32_t)triangles.size());
+// Faces are read and decoded this many at a time.
+static constexpr uint64_t kFacesPerRead = 1 << 20;
 
-  // write vertex list
-  for (const glm::vec3 & vertex : points) {
-    WriteVertex(output, vertex);
+#if defined(__SSE2__)
+// Masks over 16 consecutive faces (13 SSE registers) picking out the count bytes.
+struct FaceCountMask {
+  alignas(16) uint8_t select[16 * kPlyFaceSize];
+  alignas(16) uint8_t expect[16 * kPlyFaceSize];
+
+  constexpr FaceCountMask() : select(), expect() {
+    for (uint64_t k = 0; k < 16; k++) {
+      select[k * kPlyFaceSize] = 0xFF;
+      expect[k * kPlyFaceSize] = 3;
+    }
   }
+};
+static constexpr FaceCountMask kFaceCountMask;
+#endif
 
-  // Write triangle list
-  for (const glm::ivec3 & triangle : triangles) {
-    WriteTriangleHeader(output);
-    WriteVertexIndex(output, static_cast<uint32_t>(triangle[0]));
-    WriteVertexIndex(output, static_cast<uint32_t>(triangle[1]));
-    WriteVertexIndex(output, static_cast<uint32_t>(triangle[2]));
+// True if each of the count faces starts with a count of 3.
+static bool AllTriangles(const uint8_t *faces, const uint64_t count) {
+  uint64_t k = 0;
+#if defined(__SSE2__)
+  __m128i wrong = _mm_setzero_si128();
+  for (; k + 16 <= count; k += 16) {
+    const uint8_t *block = faces + k * kPlyFaceSize;
+    for (uint64_t i = 0; i < kPlyFaceSize; i++) {
+      const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 16 * i));
+      const __m128i select = _mm_load_si128(reinterpret_cast<const __m128i*>(kFaceCountMask.select + 16 * i));
+      const __m128i expect = _mm_load_si128(reinterpret_cast<const __m128i*>(kFaceCountMask.expect + 16 * i));
+      wrong = _mm_or_si128(wrong, _mm_xor_si128(_mm_and_si128(bytes, select), expect));
+    }
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(wrong, _mm_setzero_si128())) != 0xFFFF) {
+    return false;
+  }
+#endif
+  uint8_t wrong_tail = 0;
+  for (; k < count; k++) {
+    wrong_tail |= (uint8_t)(faces[k * kPlyFaceSize] ^ 3);
+  }
+  return wrong_tail == 0;
+}
+
+// Check that each of the count faces is a triangle of vertices below vertex_count,
+// copying them to triangles unless it's NULL. first numbers the faces in errors.
+static void DecodeFaces(const uint8_t *faces, const uint64_t count, const uint64_t first,
+                        const uint32_t vertex_count, glm::ivec3 *triangles) {
+  static_assert(sizeof(glm::ivec3) == 3*sizeof(uint32_t));
+  std::atomic<bool> all_triangles(true);
+  std::atomic<uint32_t> max_index(0);
+  ParallelFor(count, 1 << 14, [&](const uint64_t begin, const uint64_t end) {
+    const uint8_t *face = faces + begin * kPlyFaceSize;
+    if (!AllTriangles(face, end - begin)) {
+      all_triangles = false;
+    }
+    uint32_t max = 0;
+    for (uint64_t k = begin; k < end; k++, face += kPlyFaceSize) {
+      uint32_t index[3];
+      memcpy(index, face + 1, sizeof(index));
+      max = std::max(max, std::max(index[0], std::max(index[1], index[2])));
+      if (triangles != NULL) {
+        memcpy(&triangles[k], index, sizeof(index));
+      }
+    }
+    uint32_t seen = max_index;
+    while (seen < max && !max_index.compare_exchange_weak(seen, max)) {}
+  });
+
+  if (!all_triangles) {
+    for (uint64_t k = 0; k < count; k++) {
+      const uint8_t three = faces[k * kPlyFaceSize];
+      if (three != 3) {
+        fprintf(stderr, "Error reading 'three' in triangle header of face %" PRIu64 ". "
+                "It is not 3 it is %d\n", first + k, (int32_t)three);
+        std::exit(1);
+      }
+    }
+  }
+  if (count > 0 && (vertex_count == 0 || max_index >= vertex_count)) {
+    fprintf(stderr, "Error: face references vertex %u but there are only %u vertices\n",
+            (uint32_t)max_index, vertex_count);
+    std::exit(1);
   }
 }
 
 void LoadPly(const std::string &path,
              std::vector<glm::vec3> *points,
              std::vector<glm::ivec3> *triangles) {
-  FILE *input = fopen(path.c_str(), "r");
+  FILE *input = fopen(path.c_str(), "rb");
   if (input == NULL) {
     fprintf(stderr, "Error opening input\n");
     std::exit(1);
   }
 
-  uint32_t vertex_count = 0;
-  uint32_t triangle_count = 0;
-
-  ReadPlyHeader(input, &vertex_count, &triangle_count);
+  const PlyHeader header = ReadPlyHeader(input);
+  CheckMeshLayout(path, header);
+  const uint32_t vertex_count = (uint32_t)header.elements[0].count;
+  const uint32_t triangle_count = (uint32_t)header.elements[1].count;
   fprintf(stderr, "Reading %u vertices, %u faces\n", vertex_count, triangle_count);
 
-  // Read vertices
-  points->clear();
-  points->reserve(vertex_count);
-  for (uint32_t k=0; k<vertex_count; k++) {
-    static_assert(sizeof(glm::vec3) == 3*sizeof(float));
-    glm::vec3 vertex;
-    ReadVertex(input, &vertex);
-    points->emplace_back(vertex);
+  // Read vertices, which are already laid out as glm::vec3
+  static_assert(sizeof(glm::vec3) == 3*sizeof(float));
+  points->resize(vertex_count);
+  if (fread(points->data(), sizeof(glm::vec3), vertex_count, input) != vertex_count) {
+    fprintf(stderr, "Error reading vertices\n");
+    std::exit(1);
   }
 
-  // Read triangles
-  triangles->clear();
-  triangles->reserve(triangle_count);
-  for (uint32_t k=0; k<triangle_count; k++) {
-    ReadTriangleHeader(input);
-    glm::ivec3 triangle;
-    ReadVertexIndex(input, reinterpret_cast<uint32_t*>(&triangle[0]));
-    ReadVertexIndex(input, reinterpret_cast<uint32_t*>(&triangle[1]));
-    ReadVertexIndex(input, reinterpret_cast<uint32_t*>(&triangle[2]));
-    triangles->emplace_back(triangle);
+  // Read triangles a block at a time and decode each block in parallel
+  triangles->resize(triangle_count);
+  std::vector<uint8_t> buffer(std::min<uint64_t>(triangle_count, kFacesPerRead) * kPlyFaceSize);
+  for (uint64_t first = 0; first < triangle_count; first += kFacesPerRead) {
+    const uint64_t count = std::min<uint64_t>(triangle_count - first, kFacesPerRead);
+    if (fread(buffer.data(), kPlyFaceSize, count, input) != count) {
+      fprintf(stderr, "Error reading faces\n");
+      std::exit(1);
+    }
+    DecodeFaces(buffer.data(), count, first, vertex_count, triangles->data() + first);
   }
 
   fclose(input);
 }
+
+const glm::vec3 &VertexSpan::at(const uint64_t k) const {
+  if (k >= size_) {
+    fprintf(stderr, "Error: vertex %" PRIu64 " out of range, there are only %" PRIu64 "\n", k, size_);
+    std::exit(1);
+  }
+  return data_[k];
+}
+
+PlyView::PlyView(const std::string &path) :
+    mapping_(MAP_FAILED),
+    mapping_size_(0),
+    vertex_count_(0),
+    triangle_count_(0),
+    vertices_(NULL),
+    faces_(NULL) {
+  FILE *input = fopen(path.c_str(), "rb");
+  if (input == NULL) {
+    fprintf(stderr, "Error opening input %s\n", path.c_str());
+    std::exit(1);
+  }
+  const PlyHeader header = ReadPlyHeader(input);
+  fclose(input);
+  CheckMeshLayout(path, header);
+  vertex_count_ = (uint32_t)header.elements[0].count;
+  triangle_count_ = (uint32_t)header.elements[1].count;
+  fprintf(stderr, "Mapping %u vertices, %u faces\n", vertex_count_, triangle_count_);
+
+  const int fd = open(path.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "error: failed to open %s\n", path.c_str());
+    std::exit(1);
+  }
+  mapping_size_ = static_cast<uint64_t>(st.st_size);
+  const uint64_t expected_size = header.size + sizeof(glm::vec3) * vertex_count_ + kPlyFaceSize * triangle_count_;
+  if (mapping_size_ < expected_size) {
+    fprintf(stderr, "error: %s is truncated, expected %" PRIu64 " bytes but it has %" PRIu64 "\n",
+            path.c_str(), expected_size, mapping_size_);
+    std::exit(1);
+  }
+  if (mapping_size_ > 0) {
+    mapping_ = mmap(nullptr, mapping_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (mapping_ == MAP_FAILED) {
+    fprintf(stderr, "error: failed to mmap %s\n", path.c_str());
+    std::exit(1);
+  }
+  (void)madvise(mapping_, mapping_size_, MADV_SEQUENTIAL);
+
+  const uint8_t *bytes = static_cast<const uint8_t*>(mapping_);
+  if (header.size % alignof(glm::vec3) == 0) {
+    vertices_ = reinterpret_cast<const glm::vec3*>(bytes + header.size);
+  } else {
+    unaligned_vertices_.resize(vertex_count_);
+    memcpy(unaligned_vertices_.data(), bytes + header.size, sizeof(glm::vec3) * vertex_count_);
+    vertices_ = unaligned_vertices_.data();
+  }
+  faces_ = bytes + header.size + sizeof(glm::vec3) * vertex_count_;
+
+  DecodeFaces(faces_, triangle_count_, 0, vertex_count_, NULL);
+}
+
+PlyView::~PlyView() {
+  if (mapping_ != MAP_FAILED) {
+    munmap(mapping_, mapping_size_);
+  }
+}
@@ -2,10 +2,142 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
 
+enum class PlyType {
+  kInt8,
+  kUint8,
+  kInt16,
+  kUint16,
+  kInt32,
+  kUint32,
+  kFloat32,
+  kFloat64
+};
+
+struct PlyProperty {
+  std::string name;
+  PlyType type;
+  // list properties are a count of count_type followed by that many of type
+  bool is_list;
+  PlyType count_type;
+};
+
+struct PlyElement {
+  std::string name;
+  uint64_t count;
+  std::vector<PlyProperty> properties;
+};
+
+struct PlyHeader {
+  std::vector<PlyElement> elements;
+  // bytes up to and including the end_header line
+  uint64_t size;
+};
+
+// Parse the header at the start of input, leaving input at the first element.
+// Only binary_little_endian files are accepted.
+PlyHeader ReadPlyHeader(FILE * const input);
+
+// Faces as written by WriteTriangleHeader and WriteVertexIndex: a uint8 count
+// (always 3) followed by three uint32 vertex indices.
+static constexpr uint64_t kPlyFaceSize = 13;
+
+// Read-only array of vertices. Like a const std::vector<glm::vec3>, but it doesn't
+// own them, so it can point into a PlyView as well as at a vector.
+class VertexSpan {
+public:
+  VertexSpan(const glm::vec3 *data, const uint64_t size) : data_(data), size_(size) {}
+  VertexSpan(const std::vector<glm::vec3> &vertices) : data_(vertices.data()), size_(vertices.size()) {}
+
+  uint64_t size() const { return size_; }
+  const glm::vec3 *data() const { return data_; }
+  const glm::vec3 *begin() const { return data_; }
+  const glm::vec3 *end() const { return data_ + size_; }
+  const glm::vec3 &operator[](const uint64_t k) const { return data_[k]; }
+  // bounds checked, exits if k is out of range
+  const glm::vec3 &at(const uint64_t k) const;
+
+private:
+  const glm::vec3 *data_;
+  uint64_t size_;
+};
+
+// Memory mapping of a triangle mesh in the layout SavePly writes. Vertices are
+// used in place and faces are decoded on access, so nothing is copied to the heap.
+// Files whose vertex block isn't 4-byte aligned (written before WritePlyHeader
+// padded the header) have just their vertices copied.
+class PlyView {
+public:
+  explicit PlyView(const std::string &path);
+  ~PlyView();
+
+  PlyView(const PlyView&) = delete;
+  PlyView& operator=(const PlyView&) = delete;
+
+  uint32_t VertexCount() const { return vertex_count_; }
+  uint32_t TriangleCount() const { return triangle_count_; }
+
+  VertexSpan Vertices() const { return VertexSpan(vertices_, vertex_count_); }
+  const glm::vec3 &Vertex(const uint64_t k) const { return vertices_[k]; }
+
+  glm::ivec3 Triangle(const uint64_t k) const {
+    glm::ivec3 triangle;
+    memcpy(&triangle, faces_ + k * kPlyFaceSize + 1, sizeof(triangle));
+    return triangle;
+  }
+
+  // TriangleCount() faces of kPlyFaceSize bytes, ready for PlyWriter::Faces.
+  const uint8_t *FaceData() const { return faces_; }
+
+private:
+  void *mapping_;
+  uint64_t mapping_size_;
+  uint32_t vertex_count_;
+  uint32_t triangle_count_;
+  const glm::vec3 *vertices_;
+  const uint8_t *faces_;
+  std::vector<glm::vec3> unaligned_vertices_;
+};
+
+// Writes a mesh whose vertex and triangle counts are known up front. The file is
+// sized exactly and mapped, so disjoint ranges of vertices and faces can be filled
+// in from different threads. The header is written by the constructor.
+class PlyWriter {
+public:
+  PlyWriter(const std::string &path, const uint32_t vertex_count, const uint32_t triangle_count);
+  ~PlyWriter();
+
+  PlyWriter(const PlyWriter&) = delete;
+  PlyWriter& operator=(const PlyWriter&) = delete;
+
+  glm::vec3 *Vertices() { return vertices_; }
+
+  void SetTriangle(const uint64_t k, const glm::ivec3 &triangle) {
+    uint8_t *face = faces_ + k * kPlyFaceSize;
+    face[0] = 3;
+    memcpy(face + 1, &triangle, sizeof(triangle));
+  }
+
+  // triangle_count faces of kPlyFaceSize bytes, to copy already encoded faces into
+  uint8_t *Faces() { return faces_; }
+
+  // Unmap and close the file, exiting on failure. Called by the destructor if need be.
+  void Close();
+
+private:
+  std::string path_;
+  int fd_;
+  void *mapping_;
+  uint64_t mapping_size_;
+  glm::vec3 *vertices_;
+  uint8_t *faces_;
+};
+
+// Writes the header, padded so the vertex block that follows is 4-byte aligned.
 void WritePlyHeader(FILE * const output, const uint32_t vertex_count, const uint32_t triangle_count);
 void WriteTriangleHeader(FILE * const output);
 void WriteVertex(FILE * const output, const glm::vec3 &vertex);
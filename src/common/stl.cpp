@@ -2,46 +2,456 @@
 
 #define GLM_ENABLE_EXPERIMENTAL
 
-#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <glm/gtx/normal.hpp>
 #include <cstring>
 #include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "src/common/parallel.hpp"
+
+// Bytes per triangle: normal, three vertices and a zero attribute count.
+static constexpr uint64_t kStlRecordSize = 50;
+
+// Triangles buffered by StlWriter between writes.
+static constexpr uint64_t kStlBufferTriangles = 1 << 16;
+
+// Triangles packed by each thread per batch when saving a whole mesh.
+static constexpr uint64_t kStlChunkTriangles = 1 << 14;
+
+// Batch buffers between the packing threads and the writer thread.
+static constexpr int kStlRingBuffers = 3;
+
+static inline void PackTriangle(char *dst, const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2)
+{
+    const glm::vec3 normal = glm::triangleNormal(p0, p1, p2);
+    memcpy(dst, &normal, 12);
+    memcpy(dst + 12, &p0, 12);
+    memcpy(dst + 24, &p1, 12);
+    memcpy(dst + 36, &p2, 12);
+    memset(dst + 48, 0, 2);
+}
+
+// Writes the triangles a batch at a time: NumWorkers() chunks of kStlChunkTriangles
+// are packed in parallel into a ring of buffers that one writer thread drains in
+// order, so memory stays bounded however big the mesh is.
+template <class GetTriangle>
+static void WriteBinarySTL(
+    const std::string &path,
+    const VertexSpan &points,
+    const uint64_t num_triangles,
+    const GetTriangle &get_triangle)
+{
+    // TODO: properly handle endian-ness
+    const uint32_t count = static_cast<uint32_t>(num_triangles);
+
+    // Check for overflow. Quit if num triangles too big.
+    if (num_triangles != static_cast<uint64_t>(count)) {
+      std::cerr << "Error: too many triangles to represent as uint32 (" << num_triangles << ")" << std::endl;
+      exit(1);
+    }
+
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening STL output %s\n", path.c_str());
+        exit(1);
+    }
+    char header[84] = {0};
+    memcpy(header + 80, &count, 4);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+        fprintf(stderr, "Error writing STL header to %s\n", path.c_str());
+        exit(1);
+    }
+
+    struct Batch {
+        std::vector<char> bytes;
+        uint64_t triangles;
+        bool full;
+    };
+    Batch ring[kStlRingBuffers];
+    for (Batch &batch : ring) {
+        batch.triangles = 0;
+        batch.full = false;
+    }
+    std::mutex mutex;
+    std::condition_variable changed;
+    bool finished = false;
+    bool failed = false;
+
+    // The writer only records a failed write: exiting here would run static
+    // destructors under the packing threads.
+    std::thread writer([&]() {
+        for (int r = 0; ; r = (r + 1) % kStlRingBuffers) {
+            Batch &batch = ring[r];
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&batch, &finished]() { return batch.full || finished; });
+                // batches are filled in ring order, so an empty one at the end means all are written
+                if (!batch.full) {
+                    return;
+                }
+            }
+            const bool written = fwrite(batch.bytes.data(), kStlRecordSize, batch.triangles, file) == batch.triangles;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                batch.full = false;
+                failed = !written;
+            }
+            changed.notify_all();
+            if (!written) {
+                return;
+            }
+        }
+    });
+
+    const uint64_t batch_triangles = NumWorkers() * kStlChunkTriangles;
+    int r = 0;
+    for (uint64_t first = 0; first < num_triangles; first += batch_triangles, r = (r + 1) % kStlRingBuffers) {
+        Batch &batch = ring[r];
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&batch, &failed]() { return !batch.full || failed; });
+            if (failed) {
+                break;
+            }
+        }
+        const uint64_t n = std::min(batch_triangles, num_triangles - first);
+        batch.bytes.resize(n * kStlRecordSize);
+        batch.triangles = n;
+        ParallelFor(n, kStlChunkTriangles, [&](const uint64_t begin, const uint64_t end) {
+            for (uint64_t i = begin; i < end; i++) {
+                const glm::ivec3 t = get_triangle(first + i);
+                const glm::vec3 p0 = points[static_cast<uint64_t>(t.x)];
+                const glm::vec3 p1 = points[static_cast<uint64_t>(t.y)];
+                const glm::vec3 p2 = points[static_cast<uint64_t>(t.z)];
+                PackTriangle(&batch.bytes[i * kStlRecordSize], p0, p1, p2);
+            }
+        });
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            batch.full = true;
+        }
+        changed.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    changed.notify_all();
+    writer.join();
+
+    if (failed) {
+        fprintf(stderr, "Error writing STL triangles to %s\n", path.c_str());
+        exit(1);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error finishing STL output %s\n", path.c_str());
+        exit(1);
+    }
+}
 
 void SaveBinarySTL(
     const std::string &path,
     const std::vector<glm::vec3> &points,
     const std::vector<glm::ivec3> &triangles)
 {
-    // TODO: properly handle endian-ness
-    const uint64_t numBytes = triangles.size() * 50 + 84;
-    char *dst = (char *)calloc(numBytes, 1);
+    WriteBinarySTL(path, points, triangles.size(),
+                   [&triangles](const uint64_t i) { return triangles[i]; });
+}
 
-    const uint32_t count = static_cast<uint32_t>(triangles.size());
+void SaveBinarySTL(const std::string &path, const PlyView &mesh)
+{
+    WriteBinarySTL(path, mesh.Vertices(), mesh.TriangleCount(),
+                   [&mesh](const uint64_t i) { return mesh.Triangle(i); });
+}
 
-    // Check for overflow. Quit if num triangles too big.
-    if (triangles.size() != static_cast<size_t>(count)) {
-      std::cerr << "Error: too many triangles to represent as uint32 (" << triangles.size() << ")" << std::endl;
-      exit(1);
+StlWriter::StlWriter(const std::string &path) :
+    path_(path),
+    file_(fopen(path.c_str(), "wb")),
+    buffer_(kStlBufferTriangles * kStlRecordSize),
+    buffered_(0),
+    triangle_count_(0)
+{
+    if (file_ == NULL) {
+        fprintf(stderr, "Error opening STL output %s\n", path.c_str());
+        exit(1);
+    }
+    // 80 byte header, then the count, left at 0 until Close
+    const char header[84] = {0};
+    if (fwrite(header, 1, sizeof(header), file_) != sizeof(header)) {
+        fprintf(stderr, "Error writing STL header to %s\n", path.c_str());
+        exit(1);
+    }
+}
+
+StlWriter::~StlWriter()
+{
+    Close();
+}
+
+void StlWriter::Write(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2)
+{
+    if (triangle_count_ == UINT32_MAX) {
+        fprintf(stderr, "Error: too many triangles to represent as uint32 in %s\n", path_.c_str());
+        exit(1);
+    }
+    PackTriangle(&buffer_[buffered_ * kStlRecordSize], p0, p1, p2);
+    triangle_count_++;
+    if (++buffered_ == kStlBufferTriangles) {
+        Flush();
+    }
+}
+
+void StlWriter::Flush()
+{
+    if (fwrite(buffer_.data(), kStlRecordSize, buffered_, file_) != buffered_) {
+        fprintf(stderr, "Error writing STL triangles to %s\n", path_.c_str());
+        exit(1);
+    }
+    buffered_ = 0;
+}
+
+void StlWriter::Close()
+{
+    if (file_ == NULL) {
+        return;
+    }
+    Flush();
+    const uint32_t count = static_cast<uint32_t>(triangle_count_);
+    if (fseek(file_, 80, SEEK_SET) != 0 || fwrite(&count, 4, 1, file_) != 1 || fclose(file_) != 0) {
+        fprintf(stderr, "Error finishing STL output %s\n", path_.c_str());
+        exit(1);
     }
+    file_ = NULL;
+}
+
+// Triangles read and decoded at a time by LoadBinarySTL.
+static constexpr uint64_t kStlTrianglesPerRead = 1 << 20;
+
+// Radix sort digits, and the buckets per digit.
+static constexpr int kWeldDigitBits = 16;
+static constexpr uint64_t kWeldBuckets = 1 << kWeldDigitBits;
+
+// A triangle corner read from an STL: the bits of its coordinates, and where it came
+// from (3 * triangle + k). Corners with the same bits are the same vertex.
+struct WeldKey {
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+    uint32_t corner;
+};
+
+static inline bool SamePosition(const WeldKey &a, const WeldKey &b)
+{
+    return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+// Bits of a coordinate, with -0 taken as 0 so the two weld together.
+static inline uint32_t CoordinateBits(const float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    return bits == 0x80000000U ? 0 : bits;
+}
+
+// Split [0, count) into one contiguous chunk per worker; chunk c is
+// [ChunkBegin(count, chunks, c), ChunkBegin(count, chunks, c + 1)).
+static inline uint64_t ChunkBegin(const uint64_t count, const uint64_t chunks, const uint64_t c)
+{
+    return count * c / chunks;
+}
+
+// Sort keys by position with a parallel LSD radix sort, 16 bits of a coordinate per
+// pass. Each pass is stable, so corners at the same position stay in corner order.
+// Passes whose digit is the same for every key are skipped.
+static void SortWeldKeys(std::vector<WeldKey> *keys)
+{
+    const uint64_t count = keys->size();
+    const uint64_t chunks = std::max<uint64_t>(std::min<uint64_t>(NumWorkers(), count / kWeldBuckets), 1);
+    std::vector<WeldKey> scratch(count);
+    std::vector<uint64_t> offsets(chunks * kWeldBuckets);
+
+    for (uint32_t WeldKey::*field : {&WeldKey::z, &WeldKey::y, &WeldKey::x}) {
+        for (const int shift : {0, kWeldDigitBits}) {
+            const auto digit = [field, shift](const WeldKey &key) {
+                return (key.*field >> shift) & (kWeldBuckets - 1);
+            };
+
+            // per chunk histograms
+            std::fill(offsets.begin(), offsets.end(), 0);
+            ParallelFor(chunks, 1, [&](const uint64_t begin, const uint64_t end) {
+                for (uint64_t c = begin; c < end; c++) {
+                    uint64_t *histogram = &offsets[c * kWeldBuckets];
+                    for (uint64_t i = ChunkBegin(count, chunks, c); i < ChunkBegin(count, chunks, c + 1); i++) {
+                        histogram[digit((*keys)[i])]++;
+                    }
+                }
+            });
+
+            // where each chunk's run of each digit starts
+            uint64_t total = 0;
+            bool one_digit = false;
+            for (uint64_t d = 0; d < kWeldBuckets; d++) {
+                uint64_t in_bucket = 0;
+                for (uint64_t c = 0; c < chunks; c++) {
+                    const uint64_t n = offsets[c * kWeldBuckets + d];
+                    offsets[c * kWeldBuckets + d] = total;
+                    total += n;
+                    in_bucket += n;
+                }
+                one_digit = one_digit || in_bucket == count;
+            }
+            if (one_digit) {
+                continue;
+            }
+
+            ParallelFor(chunks, 1, [&](const uint64_t begin, const uint64_t end) {
+                for (uint64_t c = begin; c < end; c++) {
+                    uint64_t *next = &offsets[c * kWeldBuckets];
+                    for (uint64_t i = ChunkBegin(count, chunks, c); i < ChunkBegin(count, chunks, c + 1); i++) {
+                        scratch[next[digit((*keys)[i])]++] = (*keys)[i];
+                    }
+                }
+            });
+            keys->swap(scratch);
+        }
+    }
+}
+
+void LoadBinarySTL(
+    const std::string &path,
+    std::vector<glm::vec3> *points,
+    std::vector<glm::ivec3> *triangles)
+{
+    FILE *input = fopen(path.c_str(), "rb");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening input %s\n", path.c_str());
+        exit(1);
+    }
+    char header[84];
+    uint32_t count = 0;
+    if (fread(header, 1, sizeof(header), input) != sizeof(header) || fseek(input, 0, SEEK_END) != 0) {
+        fprintf(stderr, "Error: %s is too short to be a binary STL\n", path.c_str());
+        exit(1);
+    }
+    memcpy(&count, header + 80, 4);
+    const long size = ftell(input);
+    if (size < 0 || (uint64_t)size != 84 + count * kStlRecordSize) {
+        if (strncmp(header, "solid", 5) == 0) {
+            fprintf(stderr, "Error: %s looks like an ASCII STL, only binary STLs can be read\n", path.c_str());
+        } else {
+            fprintf(stderr, "Error: %s should be %" PRIu64 " bytes for %u triangles, but it's %ld\n",
+                    path.c_str(), 84 + count * kStlRecordSize, count, size);
+        }
+        exit(1);
+    }
+    // corners are numbered with 32 bits, and so are the vertices they weld into
+    const uint64_t corner_count = 3 * (uint64_t)count;
+    if (corner_count > INT32_MAX) {
+        fprintf(stderr, "Error: %s has too many triangles to weld (%u)\n", path.c_str(), count);
+        exit(1);
+    }
+    if (fseek(input, 84, SEEK_SET) != 0) {
+        fprintf(stderr, "Error reading triangles from %s\n", path.c_str());
+        exit(1);
+    }
+    fprintf(stderr, "Reading %u triangles\n", count);
+
+    const auto t0 = std::chrono::steady_clock::now();
+    std::vector<WeldKey> keys(corner_count);
+    std::vector<char> buffer(std::min<uint64_t>(count, kStlTrianglesPerRead) * kStlRecordSize);
+    for (uint64_t first = 0; first < count; first += kStlTrianglesPerRead) {
+        const uint64_t n = std::min<uint64_t>(count - first, kStlTrianglesPerRead);
+        if (fread(buffer.data(), kStlRecordSize, n, input) != n) {
+            fprintf(stderr, "Error reading triangles from %s\n", path.c_str());
+            exit(1);
+        }
+        ParallelFor(n, kStlChunkTriangles, [&](const uint64_t begin, const uint64_t end) {
+            for (uint64_t t = begin; t < end; t++) {
+                // skip the normal, it's recomputed on the way out
+                const char *record = &buffer[t * kStlRecordSize + 12];
+                for (uint64_t k = 0; k < 3; k++) {
+                    float xyz[3];
+                    memcpy(xyz, record + 12 * k, 12);
+                    const uint64_t corner = 3 * (first + t) + k;
+                    keys[corner] = {CoordinateBits(xyz[0]), CoordinateBits(xyz[1]), CoordinateBits(xyz[2]),
+                                    (uint32_t)corner};
+                }
+            }
+        });
+    }
+    fclose(input);
+
+    SortWeldKeys(&keys);
 
-    memcpy(dst + 80, &count, 4);
+    // Corners at one position are now together, the first to be read leading. Every
+    // corner is pointed at its leader, and each leader is a new vertex.
+    const uint64_t chunks = std::max<uint64_t>(std::min<uint64_t>(NumWorkers(), corner_count / kStlChunkTriangles), 1);
+    std::vector<uint32_t> leader(corner_count);
+    ParallelFor(chunks, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t c = begin; c < end; c++) {
+            const uint64_t first = ChunkBegin(corner_count, chunks, c);
+            // the chunk may start part way through a run of corners
+            uint64_t run = first;
+            while (run > 0 && SamePosition(keys[run - 1], keys[first])) {
+                run--;
+            }
+            for (uint64_t i = first; i < ChunkBegin(corner_count, chunks, c + 1); i++) {
+                if (!SamePosition(keys[i], keys[run])) {
+                    run = i;
+                }
+                leader[keys[i].corner] = keys[run].corner;
+            }
+        }
+    });
 
-    for (uint32_t i = 0; i < triangles.size(); i++) {
-        const glm::ivec3 t = triangles[i];
-        const glm::vec3 p0 = points[static_cast<uint64_t>(t.x)];
-        const glm::vec3 p1 = points[static_cast<uint64_t>(t.y)];
-        const glm::vec3 p2 = points[static_cast<uint64_t>(t.z)];
-        const glm::vec3 normal = glm::triangleNormal(p0, p1, p2);
-        const uint64_t idx = 84 + i * 50;
-        memcpy(dst + idx, &normal, 12);
-        memcpy(dst + idx + 12, &p0, 12);
-        memcpy(dst + idx + 24, &p1, 12);
-        memcpy(dst + idx + 36, &p2, 12);
+    // Number the vertices in order of first use, as hmply does.
+    std::vector<uint32_t> vertex(corner_count);
+    std::vector<uint64_t> first_vertex(chunks + 1, 0);
+    ParallelFor(chunks, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t c = begin; c < end; c++) {
+            for (uint64_t i = ChunkBegin(corner_count, chunks, c); i < ChunkBegin(corner_count, chunks, c + 1); i++) {
+                first_vertex[c + 1] += leader[i] == i;
+            }
+        }
+    });
+    for (uint64_t c = 0; c < chunks; c++) {
+        first_vertex[c + 1] += first_vertex[c];
     }
+    ParallelFor(chunks, 1, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t c = begin; c < end; c++) {
+            uint64_t next = first_vertex[c];
+            for (uint64_t i = ChunkBegin(corner_count, chunks, c); i < ChunkBegin(corner_count, chunks, c + 1); i++) {
+                if (leader[i] == i) {
+                    vertex[i] = (uint32_t)next++;
+                }
+            }
+        }
+    });
 
-    std::fstream file(path, std::ios::out | std::ios::binary);
-    file.write(dst, static_cast<int64_t>(numBytes));
-    file.close();
+    points->resize(first_vertex[chunks]);
+    ParallelFor(corner_count, kStlChunkTriangles, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t i = begin; i < end; i++) {
+            const WeldKey &key = keys[i];
+            if (leader[key.corner] == key.corner) {
+                uint32_t bits[3] = {key.x, key.y, key.z};
+                memcpy(&(*points)[vertex[key.corner]], bits, 12);
+            }
+        }
+    });
 
-    free(dst);
+    triangles->resize(count);
+    ParallelFor(count, kStlChunkTriangles, [&](const uint64_t begin, const uint64_t end) {
+        for (uint64_t t = begin; t < end; t++) {
+            for (uint64_t k = 0; k < 3; k++) {
+                (*triangles)[t][(int)k] = (int)vertex[leader[3 * t + k]];
+            }
+        }
+    });
+    const auto t1 = std::chrono::steady_clock::now();
+    fprintf(stderr, "Welded %" PRIu64 " corners into %zu vertices in %.2f s\n",
+            corner_count, points->size(), std::chrono::duration<double>(t1 - t0).count());
 }
@@ -1,10 +1,51 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <stdio.h>
 #include <string>
 #include <vector>
 
+#include "src/common/ply.hpp"
+
+// Save a loaded (LoadPly) or mapped (PlyView) mesh. Triangles are packed in parallel
+// and written in bounded batches, so only the input has to fit in memory.
 void SaveBinarySTL(
     const std::string &path,
     const std::vector<glm::vec3> &points,
     const std::vector<glm::ivec3> &triangles);
+void SaveBinarySTL(const std::string &path, const PlyView &mesh);
+
+// Load a binary STL as an indexed mesh, welding the three copies of each vertex
+// that its triangles carry back into one. Corners weld if their coordinates are
+// bitwise equal (or are 0 and -0). Vertices are numbered in order of first use.
+void LoadBinarySTL(
+    const std::string &path,
+    std::vector<glm::vec3> *points,
+    std::vector<glm::ivec3> *triangles);
+
+// Writes a binary STL a triangle at a time through a small buffer, for meshes that
+// are generated rather than loaded. The triangle count in the header is filled in by Close().
+class StlWriter {
+public:
+  explicit StlWriter(const std::string &path);
+  ~StlWriter();
+
+  StlWriter(const StlWriter&) = delete;
+  StlWriter& operator=(const StlWriter&) = delete;
+
+  void Write(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2);
+  uint64_t TriangleCount() const { return triangle_count_; }
+
+  // Flush, write the triangle count and close the file, exiting on failure.
+  // Called by the destructor if need be.
+  void Close();
+
+private:
+  void Flush();
+
+  std::string path_;
+  FILE *file_;
+  std::vector<char> buffer_;
+  uint64_t buffered_;
+  uint64_t triangle_count_;
+};
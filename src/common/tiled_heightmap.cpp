@@ -0,0 +1,393 @@
+#include "src/common/tiled_heightmap.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static inline uint32_t FloatBits(const float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  return bits;
+}
+
+static inline float BitsFloat(const uint32_t bits) {
+  float value;
+  memcpy(&value, &bits, 4);
+  return value;
+}
+
+static inline uint32_t ZigZag(const uint32_t delta) {
+  return (delta << 1) ^ static_cast<uint32_t>(static_cast<int32_t>(delta) >> 31);
+}
+
+static inline uint32_t UnZigZag(const uint32_t zig) {
+  return (zig >> 1) ^ (0U - (zig & 1U));
+}
+
+// PackBits variant: a control byte c < 128 is followed by c + 1 literal bytes,
+// c >= 128 is followed by one byte repeated c - 125 times (3 to 130).
+static void PackBits(const uint8_t *input, const size_t n, std::vector<uint8_t> *out) {
+  size_t i = 0;
+  while (i < n) {
+    size_t run = 1;
+    while (i + run < n && run < 130 && input[i + run] == input[i]) {
+      run++;
+    }
+    if (run >= 3) {
+      out->push_back(static_cast<uint8_t>(125 + run));
+      out->push_back(input[i]);
+      i += run;
+      continue;
+    }
+
+    // gather literals until the next run of 3 or the literal limit
+    size_t end = i;
+    while (end < n && end - i < 128) {
+      if (end + 2 < n && input[end] == input[end + 1] && input[end] == input[end + 2]) {
+        break;
+      }
+      end++;
+    }
+    out->push_back(static_cast<uint8_t>(end - i - 1));
+    out->insert(out->end(), input + i, input + end);
+    i = end;
+  }
+}
+
+// Decode exactly n bytes, returning the number of input bytes consumed.
+static size_t UnpackBits(const uint8_t *input, const size_t input_size, const size_t n, uint8_t *out) {
+  size_t in = 0;
+  size_t produced = 0;
+  while (produced < n) {
+    if (in >= input_size) {
+      fprintf(stderr, "error: truncated tile in tiled heightmap\n");
+      std::exit(1);
+    }
+    const uint8_t control = input[in++];
+    if (control < 128) {
+      const size_t count = static_cast<size_t>(control) + 1;
+      if (in + count > input_size || produced + count > n) {
+        fprintf(stderr, "error: corrupt literal run in tiled heightmap\n");
+        std::exit(1);
+      }
+      memcpy(out + produced, input + in, count);
+      in += count;
+      produced += count;
+    } else {
+      const size_t count = static_cast<size_t>(control) - 125;
+      if (in >= input_size || produced + count > n) {
+        fprintf(stderr, "error: corrupt repeat run in tiled heightmap\n");
+        std::exit(1);
+      }
+      memset(out + produced, input[in++], count);
+      produced += count;
+    }
+  }
+  return in;
+}
+
+static void EncodeTile(const float *data,
+                       const int32_t width,
+                       const uint32_t x0, const uint32_t y0,
+                       const uint32_t tw, const uint32_t th,
+                       std::vector<uint8_t> *out) {
+  const size_t n = static_cast<size_t>(tw) * th;
+  std::vector<uint8_t> planes(4 * n);
+  size_t k = 0;
+  for (uint32_t y = 0; y < th; y++) {
+    const float *row = data + static_cast<uint64_t>(y0 + y) * static_cast<uint64_t>(width) + x0;
+    // predict from the left, or from above at the start of a row
+    uint32_t prediction = y == 0 ? 0 : FloatBits(row[-width]);
+    for (uint32_t x = 0; x < tw; x++) {
+      const uint32_t bits = FloatBits(row[x]);
+      const uint32_t zig = ZigZag(bits - prediction);
+      prediction = bits;
+      planes[k] = static_cast<uint8_t>(zig);
+      planes[n + k] = static_cast<uint8_t>(zig >> 8);
+      planes[2 * n + k] = static_cast<uint8_t>(zig >> 16);
+      planes[3 * n + k] = static_cast<uint8_t>(zig >> 24);
+      k++;
+    }
+  }
+
+  out->clear();
+  for (size_t plane = 0; plane < 4; plane++) {
+    PackBits(&planes[plane * n], n, out);
+  }
+}
+
+bool IsTiledHeightmap(const std::string &path) {
+  FILE *input = fopen(path.c_str(), "rb");
+  if (input == NULL) {
+    return false;
+  }
+  char magic[8] = {0};
+  const bool is_tiled = fread(magic, 1, 8, input) == 8 && memcmp(magic, kTiledHeightmapMagic, 8) == 0;
+  fclose(input);
+  return is_tiled;
+}
+
+void WriteTiledHeightmap(const std::string &path,
+                         const int32_t width,
+                         const int32_t height,
+                         const float *data,
+                         const uint32_t tile_size) {
+  if (tile_size == 0) {
+    fprintf(stderr, "error: tile size must be positive\n");
+    std::exit(1);
+  }
+
+  TiledHeightmapHeader header{};
+  memcpy(header.magic, kTiledHeightmapMagic, 8);
+  header.version = kTiledHeightmapVersion;
+  header.tile_size = tile_size;
+  header.width = width;
+  header.height = height;
+  header.tiles_x = (static_cast<uint32_t>(width) + tile_size - 1) / tile_size;
+  header.tiles_y = (static_cast<uint32_t>(height) + tile_size - 1) / tile_size;
+  header.min = std::numeric_limits<float>::max();
+  header.max = std::numeric_limits<float>::lowest();
+  header.nan_count = 0;
+
+  std::vector<TileIndexEntry> index(static_cast<uint64_t>(header.tiles_x) * header.tiles_y);
+
+  FILE *output = fopen(path.c_str(), "wb");
+  if (output == NULL) {
+    fprintf(stderr, "Error opening output file %s.\n", path.c_str());
+    std::exit(1);
+  }
+
+  // Payloads go after the index, which is written once all offsets are known.
+  uint64_t offset = sizeof(TiledHeightmapHeader) + index.size() * sizeof(TileIndexEntry);
+  if (fseeko(output, static_cast<off_t>(offset), SEEK_SET) != 0) {
+    fprintf(stderr, "Error seeking in %s\n", path.c_str());
+    std::exit(1);
+  }
+
+  std::vector<uint8_t> payload;
+  for (uint32_t ty = 0; ty < header.tiles_y; ty++) {
+    for (uint32_t tx = 0; tx < header.tiles_x; tx++) {
+      const uint32_t x0 = tx * tile_size;
+      const uint32_t y0 = ty * tile_size;
+      const uint32_t tw = std::min(tile_size, static_cast<uint32_t>(width) - x0);
+      const uint32_t th = std::min(tile_size, static_cast<uint32_t>(height) - y0);
+
+      TileIndexEntry &entry = index[static_cast<uint64_t>(ty) * header.tiles_x + tx];
+      entry.min = std::numeric_limits<float>::max();
+      entry.max = std::numeric_limits<float>::lowest();
+      for (uint32_t y = y0; y < y0 + th; y++) {
+        const float *row = data + static_cast<uint64_t>(y) * static_cast<uint64_t>(width);
+        for (uint32_t x = x0; x < x0 + tw; x++) {
+          if (std::isnan(row[x])) {
+            entry.nan_count++;
+          } else {
+            entry.min = std::min(entry.min, row[x]);
+            entry.max = std::max(entry.max, row[x]);
+          }
+        }
+      }
+      header.nan_count += entry.nan_count;
+      header.min = std::min(header.min, entry.min);
+      header.max = std::max(header.max, entry.max);
+
+      entry.offset = offset;
+      entry.size = 0;
+      if (entry.nan_count == tw * th) {
+        continue;
+      }
+
+      EncodeTile(data, width, x0, y0, tw, th, &payload);
+      if (fwrite(payload.data(), 1, payload.size(), output) != payload.size()) {
+        fprintf(stderr, "Error writing tile (%u, %u)\n", tx, ty);
+        std::exit(1);
+      }
+      entry.size = payload.size();
+      offset += payload.size();
+    }
+  }
+
+  if (fseeko(output, 0, SEEK_SET) != 0 ||
+      fwrite(&header, sizeof(header), 1, output) != 1 ||
+      fwrite(index.data(), sizeof(TileIndexEntry), index.size(), output) != index.size()) {
+    fprintf(stderr, "Error writing tiled heightmap header\n");
+    std::exit(1);
+  }
+  fclose(output);
+}
+
+TiledHeightmap::TiledHeightmap(const std::string &path, const uint32_t cache_tiles) :
+    header_{},
+    file_(nullptr),
+    file_size_(0),
+    cache_tiles_(cache_tiles) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Failed to open image.\n");
+    std::exit(1);
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(TiledHeightmapHeader)) {
+    fprintf(stderr, "error: %s is too small to be a tiled heightmap\n", path.c_str());
+    std::exit(1);
+  }
+  file_size_ = static_cast<size_t>(st.st_size);
+  void *mapping = mmap(nullptr, file_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "error: failed to mmap %s\n", path.c_str());
+    std::exit(1);
+  }
+  // tiles are fetched in whatever order the caller asks for
+  (void)madvise(mapping, file_size_, MADV_RANDOM);
+  file_ = static_cast<const uint8_t*>(mapping);
+
+  memcpy(&header_, file_, sizeof(header_));
+  if (memcmp(header_.magic, kTiledHeightmapMagic, 8) != 0) {
+    fprintf(stderr, "error: %s is not a tiled heightmap\n", path.c_str());
+    std::exit(1);
+  }
+  if (header_.version != kTiledHeightmapVersion) {
+    fprintf(stderr, "error: %s has tiled heightmap version %u, expected %u\n",
+            path.c_str(), header_.version, kTiledHeightmapVersion);
+    std::exit(1);
+  }
+
+  if (header_.tile_size == 0 || header_.width < 0 || header_.height < 0) {
+    fprintf(stderr, "error: %s has a bad size: %d x %d in tiles of %u\n",
+            path.c_str(), header_.width, header_.height, header_.tile_size);
+    std::exit(1);
+  }
+  const uint64_t tiles_x = (static_cast<uint64_t>(header_.width) + header_.tile_size - 1) / header_.tile_size;
+  const uint64_t tiles_y = (static_cast<uint64_t>(header_.height) + header_.tile_size - 1) / header_.tile_size;
+  if (header_.tiles_x != tiles_x || header_.tiles_y != tiles_y) {
+    fprintf(stderr, "error: %s has %u x %u tiles but a %d x %d heightmap in tiles of %u needs %" PRIu64 " x %" PRIu64 "\n",
+            path.c_str(), header_.tiles_x, header_.tiles_y, header_.width, header_.height, header_.tile_size,
+            tiles_x, tiles_y);
+    std::exit(1);
+  }
+
+  const uint64_t num_tiles = static_cast<uint64_t>(header_.tiles_x) * header_.tiles_y;
+  if (sizeof(header_) + num_tiles * sizeof(TileIndexEntry) > file_size_) {
+    fprintf(stderr, "error: truncated tile index in %s\n", path.c_str());
+    std::exit(1);
+  }
+  index_.resize(num_tiles);
+  memcpy(index_.data(), file_ + sizeof(header_), num_tiles * sizeof(TileIndexEntry));
+  for (const TileIndexEntry &entry : index_) {
+    if (entry.offset + entry.size > file_size_) {
+      fprintf(stderr, "error: tile payload past the end of %s\n", path.c_str());
+      std::exit(1);
+    }
+  }
+
+  fprintf(stderr, "Reading (%d x %d) tiled heightmap, %u x %u tiles of %u...\n",
+          header_.width, header_.height, header_.tiles_x, header_.tiles_y, header_.tile_size);
+
+  if (cache_tiles_ == 0) {
+    cache_tiles_ = 2 * header_.tiles_x;
+  }
+  const uint64_t tile_floats = static_cast<uint64_t>(header_.tile_size) * header_.tile_size;
+  nan_tile_.assign(tile_floats, std::numeric_limits<float>::quiet_NaN());
+}
+
+TiledHeightmap::~TiledHeightmap() {
+  munmap(const_cast<uint8_t*>(file_), file_size_);
+}
+
+void TiledHeightmap::Decompress(const uint32_t tx, const uint32_t ty, float *dst) const {
+  const TileIndexEntry &entry = TileStats(tx, ty);
+  const uint32_t ts = header_.tile_size;
+  const uint32_t tw = std::min(ts, static_cast<uint32_t>(header_.width) - tx * ts);
+  const uint32_t th = std::min(ts, static_cast<uint32_t>(header_.height) - ty * ts);
+  const size_t n = static_cast<size_t>(tw) * th;
+
+  std::vector<uint8_t> planes(4 * n);
+  const uint8_t *input = file_ + entry.offset;
+  size_t remaining = entry.size;
+  for (size_t plane = 0; plane < 4; plane++) {
+    const size_t used = UnpackBits(input, remaining, n, &planes[plane * n]);
+    input += used;
+    remaining -= used;
+  }
+
+  size_t k = 0;
+  for (uint32_t y = 0; y < th; y++) {
+    float *row = dst + static_cast<uint64_t>(y) * ts;
+    uint32_t prediction = y == 0 ? 0 : FloatBits(row[-static_cast<int64_t>(ts)]);
+    for (uint32_t x = 0; x < tw; x++) {
+      const uint32_t zig = static_cast<uint32_t>(planes[k]) |
+                           static_cast<uint32_t>(planes[n + k]) << 8 |
+                           static_cast<uint32_t>(planes[2 * n + k]) << 16 |
+                           static_cast<uint32_t>(planes[3 * n + k]) << 24;
+      const uint32_t bits = prediction + UnZigZag(zig);
+      row[x] = BitsFloat(bits);
+      prediction = bits;
+      k++;
+    }
+  }
+}
+
+const float *TiledHeightmap::Tile(const uint32_t tx, const uint32_t ty) {
+  if (TileStats(tx, ty).size == 0) {
+    return nan_tile_.data();
+  }
+
+  const uint64_t key = static_cast<uint64_t>(ty) * header_.tiles_x + tx;
+  auto search = cache_.find(key);
+  if (search != cache_.end()) {
+    lru_.splice(lru_.begin(), lru_, search->second.lru_position);
+    return search->second.data.data();
+  }
+
+  // Reuse the least recently used tile's buffer if the cache is full.
+  std::vector<float> data;
+  if (cache_.size() >= cache_tiles_) {
+    auto evicted = cache_.find(lru_.back());
+    data = std::move(evicted->second.data);
+    cache_.erase(evicted);
+    lru_.pop_back();
+  }
+  data.assign(static_cast<uint64_t>(header_.tile_size) * header_.tile_size,
+              std::numeric_limits<float>::quiet_NaN());
+  Decompress(tx, ty, data.data());
+
+  lru_.push_front(key);
+  CachedTile &cached = cache_[key];
+  cached.data = std::move(data);
+  cached.lru_position = lru_.begin();
+  return cached.data.data();
+}
+
+float TiledHeightmap::At(const uint32_t x, const uint32_t y) {
+  const uint32_t ts = header_.tile_size;
+  const float *tile = Tile(x / ts, y / ts);
+  return tile[static_cast<uint64_t>(y % ts) * ts + x % ts];
+}
+
+void TiledHeightmap::ReadRows(const uint32_t y0, const uint32_t num_rows, float *dst) {
+  const uint32_t ts = header_.tile_size;
+  const uint64_t width = static_cast<uint64_t>(header_.width);
+  for (uint32_t y = y0; y < y0 + num_rows;) {
+    const uint32_t ty = y / ts;
+    // rows of this band that fall in tile row ty
+    const uint32_t rows = std::min(y0 + num_rows, (ty + 1) * ts) - y;
+    for (uint32_t tx = 0; tx < header_.tiles_x; tx++) {
+      const float *tile = Tile(tx, ty);
+      const uint32_t x0 = tx * ts;
+      const uint32_t tw = std::min(ts, static_cast<uint32_t>(header_.width) - x0);
+      for (uint32_t r = 0; r < rows; r++) {
+        memcpy(dst + (y - y0 + r) * width + x0,
+               tile + static_cast<uint64_t>(y % ts + r) * ts,
+               tw * sizeof(float));
+      }
+    }
+    y += rows;
+  }
+}
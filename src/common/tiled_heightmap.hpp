@@ -0,0 +1,111 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Tiled, losslessly compressed heightmap container (.hmt).
+//
+// Layout (little endian):
+//   TiledHeightmapHeader
+//   TileIndexEntry[tiles_x * tiles_y]   (row-major over tiles)
+//   compressed tile payloads
+//
+// Each tile is stored as the residuals of its float bit patterns against the
+// left neighbour (or the one above at the start of a tile row), zigzag coded,
+// split into four byte planes and PackBits run-length coded plane by plane.
+// Tiles with no valid samples have no payload at all.
+
+static constexpr char kTiledHeightmapMagic[8] = {'H', 'M', 'T', 'I', 'L', 'E', 'S', '\0'};
+static constexpr uint32_t kTiledHeightmapVersion = 1;
+
+struct TiledHeightmapHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_size;
+  int32_t width;
+  int32_t height;
+  uint32_t tiles_x;
+  uint32_t tiles_y;
+  // range of the non-NaN samples
+  float min;
+  float max;
+  uint64_t nan_count;
+};
+static_assert(sizeof(TiledHeightmapHeader) == 48);
+
+struct TileIndexEntry {
+  // payload position in the file, and its size (0 if the tile is all NaN)
+  uint64_t offset;
+  uint64_t size;
+  // range of the non-NaN samples in this tile
+  float min;
+  float max;
+  uint32_t nan_count;
+  uint32_t reserved;
+};
+static_assert(sizeof(TileIndexEntry) == 32);
+
+// True if the file at path starts with the .hmt magic.
+bool IsTiledHeightmap(const std::string &path);
+
+// Write a row-major width x height raster as a tiled heightmap.
+void WriteTiledHeightmap(const std::string &path,
+                         const int32_t width,
+                         const int32_t height,
+                         const float *data,
+                         const uint32_t tile_size);
+
+// Random access reader. Tiles are decompressed on demand and kept in an LRU cache.
+class TiledHeightmap {
+public:
+  // cache_tiles == 0 caches two rows of tiles, enough for row-order traversal.
+  TiledHeightmap(const std::string &path, const uint32_t cache_tiles);
+  ~TiledHeightmap();
+
+  TiledHeightmap(const TiledHeightmap&) = delete;
+  TiledHeightmap& operator=(const TiledHeightmap&) = delete;
+
+  int32_t Width() const { return header_.width; }
+  int32_t Height() const { return header_.height; }
+  uint64_t Size() const { return static_cast<uint64_t>(header_.width) * static_cast<uint64_t>(header_.height); }
+  uint32_t TileSize() const { return header_.tile_size; }
+
+  // Statistics straight from the header, no decompression needed.
+  float Min() const { return header_.min; }
+  float Max() const { return header_.max; }
+  uint64_t NanCount() const { return header_.nan_count; }
+  const TileIndexEntry &TileStats(const uint32_t tx, const uint32_t ty) const {
+    return index_[static_cast<uint64_t>(ty) * header_.tiles_x + tx];
+  }
+
+  // Decompressed tile, row-major with a stride of TileSize().
+  const float *Tile(const uint32_t tx, const uint32_t ty);
+
+  float At(const uint32_t x, const uint32_t y);
+
+  // Copy rows [y0, y0 + num_rows) into dst, which must hold num_rows * Width() floats.
+  void ReadRows(const uint32_t y0, const uint32_t num_rows, float *dst);
+
+private:
+  void Decompress(const uint32_t tx, const uint32_t ty, float *dst) const;
+
+  TiledHeightmapHeader header_;
+  std::vector<TileIndexEntry> index_;
+  const uint8_t *file_;
+  size_t file_size_;
+
+  uint32_t cache_tiles_;
+  // most recently used at the front
+  std::list<uint64_t> lru_;
+  struct CachedTile {
+    std::vector<float> data;
+    std::list<uint64_t>::iterator lru_position;
+  };
+  std::unordered_map<uint64_t, CachedTile> cache_;
+  // shared payload for all-NaN tiles
+  std::vector<float> nan_tile_;
+};
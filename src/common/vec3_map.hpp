@@ -0,0 +1,197 @@
+#pragma once
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <vector>
+#include <glm/glm.hpp>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Finalizer from MurmurHash3: every input bit affects every output bit, so keys
+// that differ in a few mantissa bits (like lattice coordinates 0.5, 1.5, 2.5)
+// still spread over the whole table.
+inline uint64_t Mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// Map from vertex positions to V, for deduplicating vertices. Keys are stored flat
+// and looked up by open addressing rather than in a node per entry.
+//
+// Slots come in groups of 16 with a control byte each: empty, or 7 bits of the
+// key's hash. A lookup compares a whole group's control bytes at once (with SSE2)
+// and only checks the keys whose bits match, moving on to the next group until
+// one has an empty slot. Keys are compared by their bits, 0 and -0 being the same
+// key. There's no erase.
+template <class V>
+class Vec3Map {
+public:
+  explicit Vec3Map(const uint64_t expected = 0) : size_(0) {
+    Rehash(GroupsFor(expected));
+  }
+
+  uint64_t Size() const { return size_; }
+  uint64_t Capacity() const { return control_.size(); }
+
+  // Make room for n keys without growing.
+  void Reserve(const uint64_t n) {
+    const uint64_t groups = GroupsFor(n);
+    if (groups * kGroupSize > Capacity()) {
+      Rehash(groups);
+    }
+  }
+
+  // The value of key, or NULL if it isn't there.
+  V *Find(const glm::vec3 &key) {
+    bool found;
+    const uint64_t slot = Locate(Bits(key), &found);
+    return found ? &values_[slot] : NULL;
+  }
+  const V *Find(const glm::vec3 &key) const {
+    bool found;
+    const uint64_t slot = Locate(Bits(key), &found);
+    return found ? &values_[slot] : NULL;
+  }
+
+  // The value of key, inserting V() if it isn't there.
+  V &operator[](const glm::vec3 &key) {
+    const Key bits = Bits(key);
+    bool found;
+    uint64_t slot = Locate(bits, &found);
+    if (!found) {
+      if ((size_ + 1) * 8 > Capacity() * 7) {
+        Rehash(2 * (Capacity() / kGroupSize));
+        slot = Locate(bits, &found);
+      }
+      control_[slot] = Tag(Hash(bits));
+      keys_[slot] = bits;
+      values_[slot] = V();
+      size_++;
+    }
+    return values_[slot];
+  }
+
+  static uint64_t Hash(const glm::vec3 &key) { return Hash(Bits(key)); }
+
+  // Groups of slots a lookup of key looks at, 1 being the best case.
+  uint64_t ProbeGroups(const glm::vec3 &key) const {
+    const Key bits = Bits(key);
+    const uint64_t hash = Hash(bits);
+    const uint64_t group_mask = Capacity() / kGroupSize - 1;
+    uint64_t probes = 1;
+    for (uint64_t g = (hash >> 7) & group_mask; ; g = (g + 1) & group_mask, probes++) {
+      for (uint32_t match = Match(g, Tag(hash)); match != 0; match &= match - 1) {
+        if (keys_[g * kGroupSize + (uint64_t)__builtin_ctz(match)] == bits) {
+          return probes;
+        }
+      }
+      if (Match(g, kEmpty) != 0) {
+        return probes;
+      }
+    }
+  }
+
+private:
+  static constexpr uint64_t kGroupSize = 16;
+  static constexpr uint8_t kEmpty = 0x80;
+
+  struct Key {
+    uint32_t x;
+    uint32_t y;
+    uint32_t z;
+
+    bool operator==(const Key &other) const { return x == other.x && y == other.y && z == other.z; }
+  };
+
+  static uint32_t CoordinateBits(const float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+    return bits == 0x80000000U ? 0 : bits;
+  }
+
+  static Key Bits(const glm::vec3 &key) {
+    return {CoordinateBits(key.x), CoordinateBits(key.y), CoordinateBits(key.z)};
+  }
+
+  static uint64_t Hash(const Key &key) {
+    return Mix64(Mix64((uint64_t)key.x | (uint64_t)key.y << 32) + key.z);
+  }
+
+  // Control byte of an occupied slot: the low 7 bits of its hash. Groups are
+  // picked by the bits above them.
+  static uint8_t Tag(const uint64_t hash) { return (uint8_t)(hash & 0x7F); }
+
+  // Power of two groups to hold n keys at most 7/8 full.
+  static uint64_t GroupsFor(const uint64_t n) {
+    uint64_t groups = 1;
+    while (groups * kGroupSize * 7 < n * 8) {
+      groups *= 2;
+    }
+    return groups;
+  }
+
+  // Bit k set where slot k of group g has control byte c.
+  uint32_t Match(const uint64_t g, const uint8_t c) const {
+    const uint8_t *control = &control_[g * kGroupSize];
+#if defined(__SSE2__)
+    const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(control));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)c)));
+#else
+    uint32_t mask = 0;
+    for (uint32_t k = 0; k < kGroupSize; k++) {
+      mask |= (uint32_t)(control[k] == c) << k;
+    }
+    return mask;
+#endif
+  }
+
+  // The slot holding key if it's there, else the empty slot it would go in.
+  uint64_t Locate(const Key &key, bool *found) const {
+    const uint64_t hash = Hash(key);
+    const uint64_t group_mask = Capacity() / kGroupSize - 1;
+    for (uint64_t g = (hash >> 7) & group_mask; ; g = (g + 1) & group_mask) {
+      for (uint32_t match = Match(g, Tag(hash)); match != 0; match &= match - 1) {
+        const uint64_t slot = g * kGroupSize + (uint64_t)__builtin_ctz(match);
+        if (keys_[slot] == key) {
+          *found = true;
+          return slot;
+        }
+      }
+      const uint32_t empty = Match(g, kEmpty);
+      if (empty != 0) {
+        *found = false;
+        return g * kGroupSize + (uint64_t)__builtin_ctz(empty);
+      }
+    }
+  }
+
+  void Rehash(const uint64_t groups) {
+    std::vector<uint8_t> control(groups * kGroupSize, kEmpty);
+    std::vector<Key> keys(groups * kGroupSize);
+    std::vector<V> values(groups * kGroupSize);
+    control.swap(control_);
+    keys.swap(keys_);
+    values.swap(values_);
+    for (uint64_t k = 0; k < control.size(); k++) {
+      if (control[k] != kEmpty) {
+        bool found;
+        const uint64_t slot = Locate(keys[k], &found);
+        control_[slot] = control[k];
+        keys_[slot] = keys[k];
+        values_[slot] = values[k];
+      }
+    }
+  }
+
+  std::vector<uint8_t> control_;
+  std::vector<Key> keys_;
+  std::vector<V> values_;
+  uint64_t size_;
+};
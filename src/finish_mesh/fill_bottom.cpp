@@ -12,11 +12,12 @@
 #include "src/common/ply.hpp"
 
 
-static void GetBottomEdges(const std::vector<glm::vec3> &vertices,
-                           const std::vector<glm::ivec3> &triangles,
+static void GetBottomEdges(const PlyView &mesh,
                            std::vector<glm::ivec2> *bottom_edges) {
+  const VertexSpan vertices = mesh.Vertices();
   bottom_edges->clear();
-  for (const glm::ivec3 &triangle : triangles) {
+  for (uint64_t t = 0; t < mesh.TriangleCount(); t++) {
+    const glm::ivec3 triangle = mesh.Triangle(t);
     glm::ivec2 edge;
     uint64_t num_zero_z = 0;
     // Look at the three vertices in the triangle.
@@ -85,7 +86,7 @@ static inline glm::vec2 ToXy(const glm::vec3 v3) {
 
 static glm::vec2 IntoNode(const glm::ivec2 edge,
                           const int node,
-                          const std::vector<glm::vec3> &vertices) {
+                          const VertexSpan &vertices) {
   return ToXy(vertices.at((uint64_t)node)) - ToXy(vertices.at((uint64_t)OtherNode(edge, node)));
 }
 
@@ -124,7 +125,7 @@ static glm::ivec2 ResolveNonmanifoldVertex(const int current_node,
                                            //const glm::ivec2 edge2,
                                            //const glm::ivec2 edge4,
                                            //const glm::ivec2 edge5,
-                                           const std::vector<glm::vec3> &vertices,
+                                           const VertexSpan &vertices,
                                            const Winding winding) {
 
   const glm::vec2 v0 = Normalize(IntoNode(previous_edge, current_node, vertices));
@@ -152,7 +153,7 @@ static glm::ivec2 ResolveNonmanifoldVertex(const int current_node,
 static glm::ivec2 ChooseNextEdge(const int current_node,
                                  const glm::ivec2 previous_edge,
                                  const std::vector<glm::ivec2> &connected_edges,
-                                 const std::vector<glm::vec3> &vertices,
+                                 const VertexSpan &vertices,
                                  const Winding winding) {
   // Usually there is only one edge left.
   // Ez.
@@ -188,7 +189,7 @@ static void EraseEdge(std::unordered_map<int, std::vector<glm::ivec2> > *edge_po
 }
 
 static std::vector<int> SortEdgesTurningOneWay(const std::vector<glm::ivec2> &bottom_edges,
-                                               const std::vector<glm::vec3> &vertices,
+                                               const VertexSpan &vertices,
                                                const Winding winding) {
   // Edge pool is a map from each vertex to (initially) the two edges which containt that vertex.
   std::unordered_map<int, std::vector<glm::ivec2> > edge_pool;
@@ -230,7 +231,7 @@ static std::vector<int> SortEdgesTurningOneWay(const std::vector<glm::ivec2> &bo
 }
 
 static std::vector<int> SortEdges(const std::vector<glm::ivec2> &bottom_edges,
-                                  const std::vector<glm::vec3> &vertices) {
+                                  const VertexSpan &vertices) {
   const std::vector<int> left_sorted_nodes = SortEdgesTurningOneWay(bottom_edges, vertices, Winding::kLeft);
   if (left_sorted_nodes.size() == bottom_edges.size()) {
     return left_sorted_nodes;
@@ -253,7 +254,7 @@ static std::vector<int> SortEdges(const std::vector<glm::ivec2> &bottom_edges,
 }
 
 static std::vector<glm::ivec3> Earcut(const std::vector<int> &sorted_edges,
-                                      const std::vector<glm::vec3> &vertices) {
+                                      const VertexSpan &vertices) {
   std::vector<std::array<float, 2> > polygon;
   std::vector<int> backwards_map;
   for (const int node : sorted_edges) {
@@ -285,7 +286,7 @@ static std::vector<glm::ivec3> Earcut(const std::vector<int> &sorted_edges,
 }
 
 static void WriteMatplotlibOutput(const std::string &output_path,
-                                  const std::vector<glm::vec3> &vertices,
+                                  const VertexSpan &vertices,
                                   const std::vector<glm::ivec2> &bottom_edges,
                                   const std::vector<glm::ivec3> &bottom_triangles) {
   FILE *output = fopen(output_path.c_str(), "w");
@@ -348,14 +349,13 @@ int32_t main(int32_t argc, char *argv[]) {
   assert(input_path.size() != 0);
   assert(output_path.size() != 0);
 
-  // Read inputs.
-  std::vector<glm::vec3> vertices;
-  std::vector<glm::ivec3> triangles;
-  LoadPly(input_path, &vertices, &triangles);
+  // Map inputs.
+  const PlyView mesh(input_path);
+  const VertexSpan vertices = mesh.Vertices();
 
   // Get bottom edges in no particular order
   std::vector<glm::ivec2> bottom_edges;
-  GetBottomEdges(vertices, triangles, &bottom_edges);
+  GetBottomEdges(mesh, &bottom_edges);
   fprintf(stderr, "Bottom has %zu edges\n", bottom_edges.size());
 
   // Sort the edges.
@@ -363,9 +363,14 @@ int32_t main(int32_t argc, char *argv[]) {
 
   // call mapbox earcut
   std::vector<glm::ivec3> bottom_triangles = Earcut(sorted_edges, vertices);
-  triangles.insert(triangles.end(), bottom_triangles.begin(), bottom_triangles.end());
 
-  // Write outputs.
-  SavePly(ply_output_path, vertices, triangles);
+  // Write outputs. The existing faces are copied as they are, followed by the bottom.
+  PlyWriter writer(ply_output_path, mesh.VertexCount(), mesh.TriangleCount() + (uint32_t)bottom_triangles.size());
+  memcpy(writer.Vertices(), vertices.data(), sizeof(glm::vec3) * vertices.size());
+  memcpy(writer.Faces(), mesh.FaceData(), kPlyFaceSize * mesh.TriangleCount());
+  for (uint64_t k = 0; k < bottom_triangles.size(); k++) {
+    writer.SetTriangle(mesh.TriangleCount() + k, bottom_triangles[k]);
+  }
+  writer.Close();
   WriteMatplotlibOutput(matplotlib_output_path, vertices, bottom_edges, bottom_triangles);
 }
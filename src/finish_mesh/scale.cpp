@@ -2,9 +2,10 @@
 #include <vector>
 #include <glm/glm.hpp>
 
+#include "src/common/parallel.hpp"
 #include "src/common/ply.hpp"
 
-static float Size(const std::vector<glm::vec3> &vertices) {
+static float Size(const VertexSpan &vertices) {
   float min_x = vertices.at(0).x;
   float max_x = vertices.at(0).x;
   float min_y = vertices.at(0).y;
@@ -42,23 +43,30 @@ int32_t main(int32_t argc, char *argv[]) {
 
   fprintf(stderr, "Desired max size: %.3f\n", (double)max_xy);
 
-  // Read inputs.
-  std::vector<glm::vec3> vertices;
-  std::vector<glm::ivec3> triangles;
-  LoadPly(input_path, &vertices, &triangles);
+  // Map inputs.
+  const PlyView mesh(input_path);
+  const VertexSpan vertices = mesh.Vertices();
 
   // Get min/max dimensions.
   const float initial_size = Size(vertices);
 
-  // Scale vertices.
+  // Write outputs, scaling vertices straight into the output. Faces are copied as they are.
+  PlyWriter writer(output_path, mesh.VertexCount(), mesh.TriangleCount());
+
   const float scale = max_xy / initial_size;
   fprintf(stderr, "scale factor: %.5f\n", (double)scale);
-  for (glm::vec3 &vertex : vertices) {
-    vertex.x *= scale;
-    vertex.y *= scale;
-    vertex.z *= scale;
-  }
-
-  // Write outputs.
-  SavePly(output_path, vertices, triangles);
+  glm::vec3 *scaled = writer.Vertices();
+  ParallelFor(vertices.size(), 1 << 16, [&](const uint64_t begin, const uint64_t end) {
+    for (uint64_t k = begin; k < end; k++) {
+      glm::vec3 vertex = vertices[k];
+      vertex.x *= scale;
+      vertex.y *= scale;
+      vertex.z *= scale;
+      scaled[k] = vertex;
+    }
+  });
+  ParallelFor(mesh.TriangleCount(), 1 << 16, [&](const uint64_t begin, const uint64_t end) {
+    memcpy(writer.Faces() + begin * kPlyFaceSize, mesh.FaceData() + begin * kPlyFaceSize, (end - begin) * kPlyFaceSize);
+  });
+  writer.Close();
 }
@@ -20,22 +20,34 @@ int32_t main(int32_t argc, char *argv[]) {
   assert(input_path.size() != 0);
   assert(output_path.size() != 0);
 
-  // Read inputs.
-  std::vector<glm::vec3> vertices;
-  std::vector<glm::ivec3> triangles;
-  LoadPly(input_path, &vertices, &triangles);
+  // Map inputs.
+  const PlyView mesh(input_path);
+  const VertexSpan vertices = mesh.Vertices();
 
   // Trim triangles
-  std::vector<glm::ivec3> trimmed_triangles;
-  for (const glm::ivec3 &triangle : triangles) {
+  const auto keep = [&mesh, &vertices](const uint64_t k) {
+    const glm::ivec3 triangle = mesh.Triangle(k);
     const float z0 = vertices[(uint32_t)triangle[0]].z;
     const float z1 = vertices[(uint32_t)triangle[1]].z;
     const float z2 = vertices[(uint32_t)triangle[2]].z;
-    if (z0 != 0 || z1 != 0 || z2 != 0) {
-      trimmed_triangles.emplace_back(triangle);
+    return z0 != 0 || z1 != 0 || z2 != 0;
+  };
+  uint32_t trimmed_count = 0;
+  for (uint64_t k = 0; k < mesh.TriangleCount(); k++) {
+    if (keep(k)) {
+      trimmed_count++;
     }
   }
 
-  // Write outputs.
-  SavePly(output_path, vertices, trimmed_triangles);
+  // Write outputs. Vertices and kept faces are copied as they are.
+  PlyWriter writer(output_path, mesh.VertexCount(), trimmed_count);
+  memcpy(writer.Vertices(), vertices.data(), sizeof(glm::vec3) * vertices.size());
+  uint8_t *face = writer.Faces();
+  for (uint64_t k = 0; k < mesh.TriangleCount(); k++) {
+    if (keep(k)) {
+      memcpy(face, mesh.FaceData() + k * kPlyFaceSize, kPlyFaceSize);
+      face += kPlyFaceSize;
+    }
+  }
+  writer.Close();
 }
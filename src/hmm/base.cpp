@@ -1,10 +1,8 @@
 #include "base.h"
 
-#define GLM_ENABLE_EXPERIMENTAL
-
-#include <glm/gtx/hash.hpp>
 #include <map>
-#include <unordered_map>
+
+#include "src/common/vec3_map.hpp"
 
 void AddBase(
     std::vector<glm::vec3> &points,
@@ -18,7 +16,7 @@ void AddBase(
     std::map<int, float> x1s;
     std::map<int, float> y0s;
     std::map<int, float> y1s;
-    std::unordered_map<glm::vec3, int> lookup;
+    Vec3Map<int> lookup(2 * (w + h));
 
     // find points along each edge
     for (int i = 0; i < points.size(); i++) {
@@ -52,7 +50,7 @@ void AddBase(
         const float x, const float y, const float z)
     {
         const glm::vec3 point(x, y, z);
-        if (lookup.find(point) == lookup.end()) {
+        if (lookup.Find(point) == NULL) {
             lookup[point] = points.size();
             points.push_back(point);
         }
@@ -1,51 +1,147 @@
 #include "heightmap.h"
 
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/normal.hpp>
 
 #include "blur.h"
 #include "src/common/heightmap_data.hpp"
+#include "src/common/heightmap_mosaic.hpp"
+#include "src/common/parallel.hpp"
+#include "src/common/tiled_heightmap.hpp"
 
-Heightmap::Heightmap(const std::string &path, const float zoffset_fraction) :
+// Extend [*lo, *hi] by the non-NaN samples of data.
+static void ExtendRange(const float *data, const size_t size, float *lo, float *hi) {
+    for (size_t i = 0; i < size; i++) {
+        const float z = data[i];
+        if (!std::isnan(z)) {
+            *lo = std::min(*lo, z);
+            *hi = std::max(*hi, z);
+        }
+    }
+}
+
+Heightmap::Heightmap(
+    const std::string &path,
+    const int level,
+    const HeightmapWindow &window,
+    const float zoffset_fraction) :
     m_Width(0),
     m_Height(0)
 {
-    ReadHeightmapData(path, &m_Width, &m_Height, &m_Data);
+    float lo = std::numeric_limits<float>::infinity();
+    float hi = -std::numeric_limits<float>::infinity();
+    bool scanned = false;
+    // a cropped window of the mapping is shifted down to 0 in the copy, like
+    // ReadHeightmapWindow does for the other sources
+    bool crop = false;
 
-    if (zoffset_fraction > 0) {
-        bool initialized = false;
-        float lo = m_Data[0];
-        float hi = m_Data[0];
-        for (int i = 0; i < m_Data.size(); i++) {
-            const float z = m_Data[i];
-            if (!std::isnan(z)) {
-                if (!initialized) {
-                  lo = z;
-                  hi = z;
-                  initialized = true;
-                }
-                lo = std::min(lo, z);
-                hi = std::max(hi, z);
+    // Heights in a mapping are scanned and copied into m_Data from there, in
+    // rows of m_Width from rows, stride apart. The other sources fill m_Data
+    // first, and it's fixed up in place.
+    std::unique_ptr<const HeightmapView> view;
+    const float *rows = NULL;
+    size_t stride = 0;
+    if (level == 0 && IsTiledHeightmap(path)) {
+        if (!IsWholeHeightmap(window)) {
+            fprintf(stderr, "Windowed reads of tiled heightmaps aren't supported, use the .dat\n");
+            std::exit(1);
+        }
+        // the header already has the range, so there's no need to scan
+        TiledHeightmap tiled(path, 0);
+        m_Width = tiled.Width();
+        m_Height = tiled.Height();
+        m_Data.resize(tiled.Size());
+        tiled.ReadRows(0, m_Height, m_Data.data());
+        lo = tiled.Min();
+        hi = tiled.Max();
+        scanned = true;
+    } else if (level == 0 && IsHeightmapMosaic(path)) {
+        // a window only maps the tiles it overlaps
+        HeightmapMosaic mosaic(path);
+        mosaic.ReadWindow(window, &m_Width, &m_Height, &m_Data);
+    } else {
+        // Map the file instead of reading it, so the samples are copied
+        // once and never zero-filled.
+        view.reset(new HeightmapView(path, level, PyramidPlane::kMean, HeightmapView::Access::kSequential));
+        int32_t x0 = 0;
+        int32_t y0 = 0;
+        int32_t x1 = view->Width();
+        int32_t y1 = view->Height();
+        if (!IsWholeHeightmap(window)) {
+            view->Advise(HeightmapView::Access::kRandom);
+            if (window.decimation > 1) {
+                // box filtering makes new samples, so they can't stay in the mapping
+                ReadHeightmapWindow(*view, window, &m_Width, &m_Height, &m_Data);
+                view.reset();
+            } else {
+                crop = ClampHeightmapWindow(view->Width(), view->Height(), window, &x0, &y0, &x1, &y1);
+                fprintf(stderr, "Reading (%d x %d) window at (%d, %d)...\n", x1 - x0, y1 - y0, x0, y0);
             }
         }
+        if (view) {
+            m_Width = x1 - x0;
+            m_Height = y1 - y0;
+            rows = view->Row(y0) + x0;
+            stride = view->Width();
+        }
+    }
+    if (!view) {
+        rows = m_Data.data();
+        stride = m_Width;
+    }
 
+    if ((zoffset_fraction > 0 || crop) && !scanned) {
+        for (int y = 0; y < m_Height; y++) {
+            ExtendRange(rows + y * stride, m_Width, &lo, &hi);
+        }
+    }
+    if (lo > hi) {
+        // every sample is masked
+        lo = hi = std::nanf("");
+    }
+
+    float z_offset = 0;
+    if (zoffset_fraction > 0) {
         // compute z offset from min/max height
         // relief == max - min
         // zoff / (relief + zoff) == frac
         // zoff == relief * frac / (1 - frac)
-        const float z_offset = (hi - lo) * zoffset_fraction / (1 - zoffset_fraction);
+        z_offset = (hi - lo) * zoffset_fraction / (1 - zoffset_fraction);
         fprintf(stderr, "z offset: %.2f\n", z_offset);
-
-        for (int i = 0; i < m_Data.size(); i++) {
-            m_Data[i] = m_Data[i] + z_offset;
-        }
     }
 
-    for (int i = 0; i < m_Width*m_Height; i++) {
-        if (std::isnan(m_Data[i])) {
-          m_Data[i] = 0.0;
+    // apply the shift and offset and clear masked pixels, in the same pass as the copy
+    // out of a mapping
+    const float shift = crop ? lo : 0;
+    const auto finish = [zoffset_fraction, z_offset, shift](float z) {
+        z = z - shift;
+        if (zoffset_fraction > 0) {
+            z = z + z_offset;
+        }
+        if (std::isnan(z)) {
+            z = 0.0;
+        }
+        return z;
+    };
+    if (view) {
+        m_Data.reserve((size_t)m_Width * m_Height);
+        for (int y = 0; y < m_Height; y++) {
+            const float *row = rows + y * stride;
+            for (int x = 0; x < m_Width; x++) {
+                m_Data.push_back(finish(row[x]));
+            }
+        }
+    } else {
+        for (size_t i = 0; i < m_Data.size(); i++) {
+            m_Data[i] = finish(m_Data[i]);
         }
     }
 }
@@ -60,18 +156,21 @@ Heightmap::Heightmap(
 {}
 
 void Heightmap::Invert() {
+    m_Pyramid.clear();
     for (int i = 0; i < m_Data.size(); i++) {
         m_Data[i] = 1.f - m_Data[i];
     }
 }
 
 void Heightmap::GammaCurve(const float gamma) {
+    m_Pyramid.clear();
     for (int i = 0; i < m_Data.size(); i++) {
         m_Data[i] = std::pow(m_Data[i], gamma);
     }
 }
 
 void Heightmap::AddBorder(const int size, const float z) {
+    m_Pyramid.clear();
     const int w = m_Width + size * 2;
     const int h = m_Height + size * 2;
     std::vector<float> data(w * h, z);
@@ -88,6 +187,7 @@ void Heightmap::AddBorder(const int size, const float z) {
 }
 
 void Heightmap::GaussianBlur(const int r) {
+    m_Pyramid.clear();
     m_Data = ::GaussianBlur(m_Data, m_Width, m_Height, r);
 }
 
@@ -123,10 +223,157 @@ std::vector<glm::vec3> Heightmap::Normalmap(const float zScale) const {
     return result;
 }
 
-std::pair<glm::ivec2, float> Heightmap::FindCandidate(
+// The first pixel with the highest error in a run of pixels, x being -1 if no
+// error is above 0.
+struct SpanMax {
+    float error;
+    int x;
+};
+
+#if defined(__GNUC__)
+// Pixels done at a time: a whole register, AVX2 if it's enabled, else SSE2.
+#if defined(__AVX2__)
+static constexpr int kSpanLanes = 8;
+#else
+static constexpr int kSpanLanes = 4;
+#endif
+typedef int SpanInts __attribute__((vector_size(4 * kSpanLanes)));
+typedef float SpanFloats __attribute__((vector_size(4 * kSpanLanes)));
+#endif
+
+// Find the worst pixel in [x0, x1] of row, all inside the triangle. w0, w1 and w2 are
+// the edge functions at x0 and step by a0, a1 and a2 per pixel. Each pixel's error
+// is computed with the same operations whether it's done in a vector or not.
+static SpanMax ScanSpan(
+    const float *row, const int x0, const int x1,
+    const int w0, const int w1, const int w2,
+    const int a0, const int a1, const int a2,
+    const float z0, const float z1, const float z2)
+{
+    SpanMax best = {0, -1};
+
+#if defined(__GNUC__)
+    if (x1 - x0 + 1 >= kSpanLanes) {
+        // each lane keeps its own first maximum, x -1 until it has one
+        SpanInts lane;
+        for (int k = 0; k < kSpanLanes; k++) {
+            lane[k] = k;
+        }
+        SpanInts v0 = w0 + lane * a0;
+        SpanInts v1 = w1 + lane * a1;
+        SpanInts v2 = w2 + lane * a2;
+        SpanInts xs = x0 + lane;
+        SpanFloats bestErrors = {};
+        SpanInts bestXs = SpanInts{} - 1;
+        for (int x = x0; x <= x1; x += kSpanLanes) {
+            SpanFloats heights = {};
+            if (x + kSpanLanes - 1 <= x1) {
+                memcpy(&heights, row + x, sizeof(heights));
+            } else {
+                // don't read past the end of the span on the last step
+                for (int k = 0; x + k <= x1; k++) {
+                    heights[k] = row[x + k];
+                }
+            }
+            const SpanFloats z =
+                z0 * __builtin_convertvector(v0, SpanFloats) +
+                z1 * __builtin_convertvector(v1, SpanFloats) +
+                z2 * __builtin_convertvector(v2, SpanFloats);
+            const SpanFloats d = z - heights;
+            const SpanFloats dz = d < 0 ? -d : d;
+            const SpanInts better = (dz > bestErrors) & (xs <= x1);
+            bestErrors = better ? dz : bestErrors;
+            bestXs = better ? xs : bestXs;
+            v0 += a0 * kSpanLanes;
+            v1 += a1 * kSpanLanes;
+            v2 += a2 * kSpanLanes;
+            xs += kSpanLanes;
+        }
+
+        // the first pixel with the highest error is the leftmost of the lanes' maxima
+        for (int k = 0; k < kSpanLanes; k++) {
+            if (bestXs[k] >= 0 && (bestErrors[k] > best.error || (bestErrors[k] == best.error && bestXs[k] < best.x))) {
+                best.error = bestErrors[k];
+                best.x = bestXs[k];
+            }
+        }
+        return best;
+    }
+#endif
+
+    int v0 = w0;
+    int v1 = w1;
+    int v2 = w2;
+    for (int x = x0; x <= x1; x++) {
+        // compute z using barycentric coordinates
+        const float z = z0 * v0 + z1 * v1 + z2 * v2;
+        const float dz = std::abs(z - row[x]);
+        if (dz > best.error) {
+            best.error = dz;
+            best.x = x;
+        }
+        v0 += a0;
+        v1 += a1;
+        v2 += a2;
+    }
+    return best;
+}
+
+// Pixels on a side of the blocks at the bottom of the pyramid.
+static constexpr int kPyramidBlockSize = 16;
+
+// Triangles with fewer pixels in their bounding box are scanned row by row
+// without looking at the pyramid.
+static constexpr int64_t kPyramidMinPixels = 64 * 64;
+
+void Heightmap::BuildPyramid() {
+    m_Pyramid.clear();
+    int blockSize = kPyramidBlockSize;
+    while (true) {
+        PyramidLevel level;
+        level.blockSize = blockSize;
+        level.width = (m_Width + blockSize - 1) / blockSize;
+        level.height = (m_Height + blockSize - 1) / blockSize;
+        level.lo.assign(level.width * level.height, std::numeric_limits<float>::infinity());
+        level.hi.assign(level.width * level.height, -std::numeric_limits<float>::infinity());
+        if (m_Pyramid.empty()) {
+            for (int y = 0; y < m_Height; y++) {
+                for (int x = 0; x < m_Width; x++) {
+                    const int i = (y / blockSize) * level.width + x / blockSize;
+                    level.lo[i] = std::min(level.lo[i], At(x, y));
+                    level.hi[i] = std::max(level.hi[i], At(x, y));
+                }
+            }
+        } else {
+            const PyramidLevel &below = m_Pyramid.back();
+            for (int y = 0; y < below.height; y++) {
+                for (int x = 0; x < below.width; x++) {
+                    const int i = (y / 4) * level.width + x / 4;
+                    level.lo[i] = std::min(level.lo[i], below.lo[y * below.width + x]);
+                    level.hi[i] = std::max(level.hi[i], below.hi[y * below.width + x]);
+                }
+            }
+        }
+        m_Pyramid.push_back(std::move(level));
+        if (m_Pyramid.back().width <= 4 && m_Pyramid.back().height <= 4) {
+            break;
+        }
+        blockSize *= 4;
+    }
+}
+
+// Whether error e at pixel p beats error f at pixel q: it's bigger, or the same
+// at a pixel that comes first in raster order.
+static bool Beats(const float e, const glm::ivec2 p, const float f, const glm::ivec2 q) {
+    return e > f || (e == f && (p.y < q.y || (p.y == q.y && p.x < q.x)));
+}
+
+std::pair<glm::ivec2, float> Heightmap::FindCandidateRows(
     const glm::ivec2 p0,
     const glm::ivec2 p1,
-    const glm::ivec2 p2) const
+    const glm::ivec2 p2,
+    const int y0,
+    const int y1) const
 {
     const auto edge = [](
         const glm::ivec2 a, const glm::ivec2 b, const glm::ivec2 c)
@@ -138,16 +385,15 @@ std::pair<glm::ivec2, float> Heightmap::FindCandidate(
     const glm::ivec2 min = glm::min(glm::min(p0, p1), p2);
     const glm::ivec2 max = glm::max(glm::max(p0, p1), p2);
 
-    // forward differencing variables
-    int w00 = edge(p1, p2, min);
-    int w01 = edge(p2, p0, min);
-    int w02 = edge(p0, p1, min);
-    const int a01 = p1.y - p0.y;
-    const int b01 = p0.x - p1.x;
-    const int a12 = p2.y - p1.y;
-    const int b12 = p1.x - p2.x;
-    const int a20 = p0.y - p2.y;
-    const int b20 = p2.x - p0.x;
+    // Edge functions at the top left of the bounding box, and their steps along
+    // x (a) and y (b). Edge i is >= 0 on the inside, and at pixel (x, y) it's
+    // ws[i] + as[i] * (x - min.x) + bs[i] * (y - min.y).
+    const int ws[3] = {edge(p1, p2, min), edge(p2, p0, min), edge(p0, p1, min)};
+    const int as[3] = {p2.y - p1.y, p0.y - p2.y, p1.y - p0.y};
+    const int bs[3] = {p1.x - p2.x, p2.x - p0.x, p0.x - p1.x};
+    const auto edgeAt = [&ws, &as, &bs, min](const int i, const int x, const int y) {
+        return (int64_t)ws[i] + (int64_t)as[i] * (x - min.x) + (int64_t)bs[i] * (y - min.y);
+    };
 
     // pre-multiplied z values at vertices
     const float a = edge(p0, p1, p2);
@@ -155,57 +401,164 @@ std::pair<glm::ivec2, float> Heightmap::FindCandidate(
     const float z1 = At(p1) / a;
     const float z2 = At(p2) / a;
 
-    // iterate over pixels in bounding box
+    // The worst pixel so far. Blocks aren't scanned in raster order, so ties go
+    // to the pixel that comes first in it, as they would in a plain scan.
     float maxError = 0;
     glm::ivec2 maxPoint(0);
-    for (int y = min.y; y <= max.y; y++) {
-        // compute starting offset
-        int dx = 0;
-        if (w00 < 0 && a12 != 0) {
-            dx = std::max(dx, -w00 / a12);
-        }
-        if (w01 < 0 && a20 != 0) {
-            dx = std::max(dx, -w01 / a20);
-        }
-        if (w02 < 0 && a01 != 0) {
-            dx = std::max(dx, -w02 / a01);
-        }
 
-        int w0 = w00 + a12 * dx;
-        int w1 = w01 + a20 * dx;
-        int w2 = w02 + a01 * dx;
-
-        bool wasInside = false;
+    // scan the pixels inside the triangle in rows [y0, y1] and columns [x0, x1]
+    const auto scan = [&](const int x0, const int y0, const int x1, const int y1) {
+        for (int y = y0; y <= y1; y++) {
+            // Each edge function is linear along the row, so the pixels inside
+            // the triangle are the offsets k in [lo, hi] where all three are >= 0.
+            int64_t lo = x0 - min.x;
+            int64_t hi = x1 - min.x;
+            for (int i = 0; i < 3; i++) {
+                const int64_t w = edgeAt(i, min.x, y);
+                const int64_t s = as[i];
+                if (s > 0) {
+                    if (w < 0) {
+                        lo = std::max(lo, (-w + s - 1) / s);
+                    }
+                } else if (w < 0) {
+                    hi = -1;
+                } else if (s < 0) {
+                    hi = std::min(hi, w / -s);
+                }
+            }
+            if (lo > hi) {
+                continue;
+            }
 
-        for (int x = min.x + dx; x <= max.x; x++) {
-            // check if inside triangle
-            if (w0 >= 0 && w1 >= 0 && w2 >= 0) {
-                wasInside = true;
+            const int x = min.x + lo;
+            const SpanMax best = ScanSpan(
+                &m_Data[y * m_Width], x, min.x + hi,
+                edgeAt(0, x, y), edgeAt(1, x, y), edgeAt(2, x, y),
+                as[0], as[1], as[2], z0, z1, z2);
+            if (best.x >= 0 && Beats(best.error, glm::ivec2(best.x, y), maxError, maxPoint)) {
+                maxError = best.error;
+                maxPoint = glm::ivec2(best.x, y);
+            }
+        }
+    };
 
-                // compute z using barycentric coordinates
-                const float z = z0 * w0 + z1 * w1 + z2 * w2;
-                const float dz = std::abs(z - At(x, y));
-                if (dz > maxError) {
-                    maxError = dz;
-                    maxPoint = glm::ivec2(x, y);
+    const int64_t pixels = (int64_t)(max.x - min.x + 1) * (y1 - y0 + 1);
+    if (m_Pyramid.empty() || pixels < kPyramidMinPixels || a == 0) {
+        scan(min.x, y0, max.x, y1);
+    } else {
+        // A block's pixels can't be off the triangle's plane by more than the
+        // plane's range over the block against the block's height range. The
+        // bound is in doubles, so it's padded for the rounding of the float
+        // error it bounds.
+        struct Block {
+            float reach;
+            int level;
+            int x;
+            int y;
+            bool operator<(const Block &other) const { return reach < other.reach; }
+        };
+        const double h0 = At(p0);
+        const double h1 = At(p1);
+        const double h2 = At(p2);
+        const auto push = [&](std::priority_queue<Block> *blocks, const int l, const int bx, const int by) {
+            const PyramidLevel &level = m_Pyramid[l];
+            const int x0 = std::max(bx * level.blockSize, min.x);
+            const int top = std::max(by * level.blockSize, y0);
+            const int x1 = std::min((bx + 1) * level.blockSize - 1, max.x);
+            const int bottom = std::min((by + 1) * level.blockSize - 1, y1);
+            if (x0 > x1 || top > bottom) {
+                return;
+            }
+            const int corners[4][2] = {{x0, top}, {x1, top}, {x0, bottom}, {x1, bottom}};
+            // skip blocks wholly outside an edge
+            for (int i = 0; i < 3; i++) {
+                int64_t w = INT64_MIN;
+                for (const auto &c : corners) {
+                    w = std::max(w, edgeAt(i, c[0], c[1]));
                 }
-            } else if (wasInside) {
-                break;
+                if (w < 0) {
+                    return;
+                }
+            }
+            double planeLo = std::numeric_limits<double>::infinity();
+            double planeHi = -std::numeric_limits<double>::infinity();
+            for (const auto &c : corners) {
+                const double z = (h0 * edgeAt(0, c[0], c[1]) + h1 * edgeAt(1, c[0], c[1]) +
+                                  h2 * edgeAt(2, c[0], c[1])) / a;
+                planeLo = std::min(planeLo, z);
+                planeHi = std::max(planeHi, z);
             }
+            const double lo = level.lo[by * level.width + bx];
+            const double hi = level.hi[by * level.width + bx];
+            const double bound = std::max(planeHi - lo, hi - planeLo);
+            const double margin = 1e-5 * (std::abs(h0) + std::abs(h1) + std::abs(h2) +
+                                          std::max(std::abs(lo), std::abs(hi))) + 1e-6;
+            blocks->push({(float)(bound + margin), l, bx, by});
+        };
 
-            w0 += a12;
-            w1 += a20;
-            w2 += a01;
+        // Open the blocks with the most reach first, and stop once none left can
+        // beat the worst pixel found.
+        std::priority_queue<Block> blocks;
+        const int top = m_Pyramid.size() - 1;
+        const PyramidLevel &topLevel = m_Pyramid[top];
+        for (int by = y0 / topLevel.blockSize; by <= y1 / topLevel.blockSize; by++) {
+            for (int bx = min.x / topLevel.blockSize; bx <= max.x / topLevel.blockSize; bx++) {
+                push(&blocks, top, bx, by);
+            }
         }
+        while (!blocks.empty() && blocks.top().reach >= maxError) {
+            const Block block = blocks.top();
+            blocks.pop();
+            if (block.level == 0) {
+                const int size = m_Pyramid[0].blockSize;
+                scan(std::max(block.x * size, min.x), std::max(block.y * size, y0),
+                     std::min((block.x + 1) * size - 1, max.x), std::min((block.y + 1) * size - 1, y1));
+                continue;
+            }
+            const PyramidLevel &below = m_Pyramid[block.level - 1];
+            for (int by = block.y * 4; by < std::min(block.y * 4 + 4, below.height); by++) {
+                for (int bx = block.x * 4; bx < std::min(block.x * 4 + 4, below.width); bx++) {
+                    push(&blocks, block.level - 1, bx, by);
+                }
+            }
+        }
+    }
+
+    return std::make_pair(maxPoint, maxError);
+}
 
-        w00 += b12;
-        w01 += b20;
-        w02 += b01;
+// Fewest rows a thread takes.
+static constexpr uint64_t kParallelMinRows = 64;
+
+std::pair<glm::ivec2, float> Heightmap::FindCandidate(
+    const glm::ivec2 p0,
+    const glm::ivec2 p1,
+    const glm::ivec2 p2) const
+{
+    const glm::ivec2 min = glm::min(glm::min(p0, p1), p2);
+    const glm::ivec2 max = glm::max(glm::max(p0, p1), p2);
+    const int64_t rows = max.y - min.y + 1;
+
+    std::pair<glm::ivec2, float> best;
+    if ((int64_t)(max.x - min.x + 1) * rows < kParallelMinPixels) {
+        best = FindCandidateRows(p0, p1, p2, min.y, max.y);
+    } else {
+        // Beats picks the same pixel whatever order the bands finish in, so the
+        // result doesn't depend on the number of threads.
+        best = std::make_pair(glm::ivec2(0), 0.0f);
+        std::mutex mutex;
+        ParallelFor(rows, kParallelMinRows, [&](const uint64_t begin, const uint64_t end) {
+            const auto band = FindCandidateRows(p0, p1, p2, min.y + begin, min.y + end - 1);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (Beats(band.second, band.first, best.second, best.first)) {
+                best = band;
+            }
+        });
     }
 
-    if (maxPoint == p0 || maxPoint == p1 || maxPoint == p2) {
-        maxError = 0;
+    if (best.first == p0 || best.first == p1 || best.first == p2) {
+        best.second = 0;
     }
 
-    return std::make_pair(maxPoint, maxError);
+    return best;
 }
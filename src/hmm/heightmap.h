@@ -5,9 +5,15 @@
 #include <utility>
 #include <vector>
 
+#include "src/common/heightmap_data.hpp"
+
 class Heightmap {
 public:
-    Heightmap(const std::string &path, const float zoffset_fraction);
+    Heightmap(
+        const std::string &path,
+        const int level,
+        const HeightmapWindow &window,
+        const float zoffset_fraction);
 
     Heightmap(
         const int width,
@@ -42,13 +48,41 @@ public:
 
     std::vector<glm::vec3> Normalmap(const float zScale) const;
 
+    // Build the min/max pyramid FindCandidate uses to skip the parts of large
+    // triangles that can't hold the worst pixel. Call it once the heightmap is
+    // final; changing the heightmap drops it.
+    void BuildPyramid();
+
+    // FindCandidate splits the rows of triangles with at least this many pixels
+    // in their bounding box between threads.
+    static constexpr int64_t kParallelMinPixels = 1 << 20;
+
     std::pair<glm::ivec2, float> FindCandidate(
         const glm::ivec2 p0,
         const glm::ivec2 p1,
         const glm::ivec2 p2) const;
 
 private:
+    // Lowest and highest height in each square block of pixels, blocks of one
+    // level being made of 4 x 4 blocks of the level below.
+    struct PyramidLevel {
+        int blockSize;
+        int width;
+        int height;
+        std::vector<float> lo;
+        std::vector<float> hi;
+    };
+
     int m_Width;
     int m_Height;
     std::vector<float> m_Data;
+    std::vector<PyramidLevel> m_Pyramid;
+
+    // The worst pixel of the triangle in rows [y0, y1], vertices included.
+    std::pair<glm::ivec2, float> FindCandidateRows(
+        const glm::ivec2 p0,
+        const glm::ivec2 p1,
+        const glm::ivec2 p2,
+        const int y0,
+        const int y1) const;
 };
@@ -22,7 +22,12 @@ int main(int argc, char **argv) {
     p.add<float>("error", 'e', "maximum triangulation error", false, 0.001);
     p.add<int>("triangles", 't', "maximum number of triangles", false, 0);
     p.add<int>("points", 'p', "maximum number of vertices", false, 0);
+    p.add<int>("queue-arity", '\0', "children per node of the triangle queue's heap (2 reproduces earlier meshes)", false, 8, cmdline::oneof<int>(2, 4, 8));
+    p.add<int>("batch", '\0', "points inserted before rasterizing their triangles (1 is strictly greedy)", false, 1, cmdline::range(1, 1 << 20));
     p.add<float>("zoffset_fraction", '\0', "base fraction", false, -1);
+    p.add<std::string>("window", '\0', "pixel window x0,y0,width,height to load, shifted down to 0", false, "");
+    p.add<int>("decimation", '\0', "box filter decimation factor", false, 1, cmdline::range(1, 1 << 16));
+    p.add<int>("level", '\0', "pyramid level to load (needs build_pyramid's sidecar)", false, 0, cmdline::range(0, 31));
     p.add<float>("base", 'b', "solid base height", false, 0);
     p.add("invert", '\0', "invert heightmap");
     p.add<int>("blur", '\0', "gaussian blur sigma", false, 0);
@@ -46,7 +51,17 @@ int main(int argc, char **argv) {
     const float maxError = p.get<float>("error");
     const int maxTriangles = p.get<int>("triangles");
     const int maxPoints = p.get<int>("points");
+    const int batchSize = p.get<int>("batch");
+    const int queueArity = p.get<int>("queue-arity");
     const float zoffset_fraction = p.get<float>("zoffset_fraction");
+    const int level = p.get<int>("level");
+    HeightmapWindow window = kWholeHeightmap;
+    if (!p.get<std::string>("window").empty() &&
+        !ParseHeightmapWindow(p.get<std::string>("window").c_str(), &window)) {
+        std::cerr << "window must be x0,y0,width,height" << std::endl << p.usage();
+        std::exit(1);
+    }
+    window.decimation = p.get<int>("decimation");
     const float baseHeight = p.get<float>("base");
     const bool invert = p.exist("invert");
     const int blurSigma = p.get<int>("blur");
@@ -74,7 +89,7 @@ int main(int argc, char **argv) {
 
     // load heightmap
     auto done = timed("loading heightmap");
-    const auto hm = std::make_shared<Heightmap>(inFile, zoffset_fraction);
+    const auto hm = std::make_shared<Heightmap>(inFile, level, window, zoffset_fraction);
     done();
 
     int w = hm->Width();
@@ -117,10 +132,13 @@ int main(int argc, char **argv) {
     w = hm->Width();
     h = hm->Height();
 
+    // the heightmap is final, so FindCandidate can prune with its pyramid
+    hm->BuildPyramid();
+
     // triangulate
     done = timed("triangulating");
-    Triangulator tri(hm);
-    tri.Run(maxError, maxTriangles, maxPoints);
+    Triangulator tri(hm, __builtin_ctz(queueArity));
+    tri.Run(maxError, maxTriangles, maxPoints, batchSize);
     auto points = tri.Points(zScale * zExaggeration);
     auto triangles = tri.Triangles();
     done();
@@ -2,13 +2,19 @@
 
 #include <algorithm>
 
-Triangulator::Triangulator(const std::shared_ptr<Heightmap> &heightmap) :
-    m_Heightmap(heightmap) {}
+#include "src/common/parallel.hpp"
+
+Triangulator::Triangulator(
+    const std::shared_ptr<Heightmap> &heightmap,
+    const int queueLog2Arity) :
+    m_Heightmap(heightmap),
+    m_QueueLog2Arity(queueLog2Arity) {}
 
 void Triangulator::Run(
     const float maxError,
     const int maxTriangles,
-    const int maxPoints)
+    const int maxPoints,
+    const int batchSize)
 {
     // add points at all four corners
     const int x0 = 0;
@@ -25,13 +31,14 @@ void Triangulator::Run(
     AddTriangle(p0, p3, p1, t0, -1, -1, -1);
     Flush();
 
-    // helper function to check if triangulation is complete
+    // helper function to check if triangulation is complete, counting the
+    // triangles of the batch so far that aren't rasterized yet
     const auto done = [this, maxError, maxTriangles, maxPoints]() {
         const float e = Error();
         if (e <= maxError) {
             return true;
         }
-        if (maxTriangles > 0 && NumTriangles() >= maxTriangles) {
+        if (maxTriangles > 0 && NumTriangles() + (int)m_Pending.size() >= maxTriangles) {
             return true;
         }
         if (maxPoints > 0 && NumPoints() >= maxPoints) {
@@ -40,13 +47,20 @@ void Triangulator::Run(
         return e == 0;
     };
 
+    // The triangles a batch's points create wait for the next batch to be
+    // rasterized, so within a batch points go in the worst triangles left of
+    // those known when it started. That's strictly greedy for a batch of 1.
     while (!done()) {
         Step();
+        for (int i = 1; i < batchSize && !m_Queue.empty() && !done(); i++) {
+            Step();
+        }
+        Flush();
     }
 }
 
 float Triangulator::Error() const {
-    return m_Errors[m_Queue[0]];
+    return m_Queue[0].error;
 }
 
 std::vector<glm::vec3> Triangulator::Points(const float zScale) const {
@@ -62,7 +76,8 @@ std::vector<glm::vec3> Triangulator::Points(const float zScale) const {
 std::vector<glm::ivec3> Triangulator::Triangles() const {
     std::vector<glm::ivec3> triangles;
     triangles.reserve(m_Queue.size());
-    for (const int i : m_Queue) {
+    for (const QueueEntry &entry : m_Queue) {
+        const int i = entry.triangle;
         triangles.emplace_back(
             m_Triangles[i * 3 + 0],
             m_Triangles[i * 3 + 1],
@@ -71,9 +86,13 @@ std::vector<glm::ivec3> Triangulator::Triangles() const {
     return triangles;
 }
 
+// Fewest bounding box pixels of pending triangles a thread rasterizes, so a
+// flush of a few small triangles stays on the calling thread.
+static constexpr int64_t kParallelFlushPixels = 1 << 18;
+
 void Triangulator::Flush() {
-    for (const int t : m_Pending) {
-        // rasterize triangle to find maximum pixel error
+    // rasterize triangle t to find maximum pixel error
+    const auto rasterize = [this](const int t) {
         const auto pair = m_Heightmap->FindCandidate(
             m_Points[m_Triangles[t*3+0]],
             m_Points[m_Triangles[t*3+1]],
@@ -81,8 +100,65 @@ void Triangulator::Flush() {
         // update metadata
         m_Candidates[t] = pair.first;
         m_Errors[t] = pair.second;
-        // add triangle to priority queue
-        QueuePush(t);
+    };
+
+    // Triangles big enough for FindCandidate to split between threads itself go
+    // first, one at a time. The rest are indexed by their bounding box pixels
+    // so far, so they can be split into chunks of about equal work.
+    std::vector<int> small;
+    std::vector<int64_t> smallStart;
+    int64_t pixels = 0;
+    for (int i = 0; i < (int)m_Pending.size(); i++) {
+        const int t = m_Pending[i];
+        const glm::ivec2 p0 = m_Points[m_Triangles[t*3+0]];
+        const glm::ivec2 p1 = m_Points[m_Triangles[t*3+1]];
+        const glm::ivec2 p2 = m_Points[m_Triangles[t*3+2]];
+        const glm::ivec2 size = glm::max(glm::max(p0, p1), p2) - glm::min(glm::min(p0, p1), p2) + 1;
+        const int64_t area = (int64_t)size.x * size.y;
+        if (area >= Heightmap::kParallelMinPixels) {
+            rasterize(t);
+        } else {
+            small.push_back(i);
+            smallStart.push_back(pixels);
+            pixels += area;
+        }
+    }
+
+    // Most flushes are a few small triangles: skip setting up the split.
+    if (pixels < kParallelFlushPixels) {
+        for (const int k : small) {
+            rasterize(m_Pending[k]);
+        }
+        for (const int t : m_Pending) {
+            // add triangle to priority queue
+            QueuePush(t);
+        }
+        m_Pending.clear();
+        return;
+    }
+
+    // Rasterizing only writes the pending triangles' own metadata, so the
+    // chunks can run at once. The queue takes them in pending order: up to the
+    // end of the first chunk (on this thread) as soon as it's done, the rest
+    // after.
+    uint64_t pushed = 0;
+    ParallelFor(pixels, kParallelFlushPixels, [&](const uint64_t begin, const uint64_t end) {
+        // the triangles starting in pixels [begin, end)
+        const int first = std::lower_bound(smallStart.begin(), smallStart.end(), (int64_t)begin) - smallStart.begin();
+        const int last = std::lower_bound(smallStart.begin(), smallStart.end(), (int64_t)end) - smallStart.begin();
+        for (int k = first; k < last; k++) {
+            rasterize(m_Pending[small[k]]);
+        }
+        if (begin == 0) {
+            const uint64_t done = last < (int)small.size() ? small[last] : m_Pending.size();
+            for (uint64_t i = 0; i < done; i++) {
+                QueuePush(m_Pending[i]);
+            }
+            pushed = done;
+        }
+    });
+    for (uint64_t i = pushed; i < m_Pending.size(); i++) {
+        QueuePush(m_Pending[i]);
     }
 
     m_Pending.clear();
@@ -172,8 +248,6 @@ void Triangulator::Step() {
         Legalize(t1);
         Legalize(t2);
     }
-
-    Flush();
 }
 
 int Triangulator::AddPoint(const glm::ivec2 point) {
@@ -305,7 +379,7 @@ void Triangulator::Legalize(const int a) {
 void Triangulator::QueuePush(const int t) {
     const int i = m_Queue.size();
     m_QueueIndexes[t] = i;
-    m_Queue.push_back(t);
+    m_Queue.push_back({m_Errors[t], t});
     QueueUp(i);
 }
 
@@ -317,7 +391,7 @@ int Triangulator::QueuePop() {
 }
 
 int Triangulator::QueuePopBack() {
-    const int t = m_Queue.back();
+    const int t = m_Queue.back().triangle;
     m_Queue.pop_back();
     m_QueueIndexes[t] = -1;
     return t;
@@ -346,22 +420,19 @@ void Triangulator::QueueRemove(const int t) {
 }
 
 bool Triangulator::QueueLess(const int i, const int j) const {
-    return -m_Errors[m_Queue[i]] < -m_Errors[m_Queue[j]];
+    return -m_Queue[i].error < -m_Queue[j].error;
 }
 
 void Triangulator::QueueSwap(const int i, const int j) {
-    const int pi = m_Queue[i];
-    const int pj = m_Queue[j];
-    m_Queue[i] = pj;
-    m_Queue[j] = pi;
-    m_QueueIndexes[pi] = j;
-    m_QueueIndexes[pj] = i;
+    std::swap(m_Queue[i], m_Queue[j]);
+    m_QueueIndexes[m_Queue[i].triangle] = i;
+    m_QueueIndexes[m_Queue[j].triangle] = j;
 }
 
 void Triangulator::QueueUp(const int j0) {
     int j = j0;
     while (1) {
-        int i = (j - 1) / 2;
+        int i = j > 0 ? (j - 1) >> m_QueueLog2Arity : 0;
         if (i == j || !QueueLess(j, i)) {
             break;
         }
@@ -373,14 +444,17 @@ void Triangulator::QueueUp(const int j0) {
 bool Triangulator::QueueDown(const int i0, const int n) {
     int i = i0;
     while (1) {
-        const int j1 = 2 * i + 1;
+        const int j1 = (i << m_QueueLog2Arity) + 1;
         if (j1 >= n || j1 < 0) {
             break;
         }
-        const int j2 = j1 + 1;
+        // the first of the smallest children
+        const int j2 = std::min(j1 + (1 << m_QueueLog2Arity), n);
         int j = j1;
-        if (j2 < n && QueueLess(j2, j1)) {
-            j = j2;
+        for (int k = j1 + 1; k < j2; k++) {
+            if (QueueLess(k, j)) {
+                j = k;
+            }
         }
         if (!QueueLess(j, i)) {
             break;
@@ -8,12 +8,24 @@
 
 class Triangulator {
 public:
-    Triangulator(const std::shared_ptr<Heightmap> &heightmap);
-
+    // The queue of triangles by error is a heap with 1 << queueLog2Arity
+    // children per node. Heaps of different arity break ties between equal
+    // errors differently, so they give different meshes of the same error.
+    // 8-ary is the default because it spends the least time in the queue;
+    // binary reproduces the meshes of earlier versions.
+    Triangulator(
+        const std::shared_ptr<Heightmap> &heightmap,
+        const int queueLog2Arity = 3);
+
+    // Insert points until the error, triangle or point budget is met.
+    // batchSize points are inserted before their new triangles are rasterized
+    // together; 1 is strictly greedy, larger batches trade some mesh quality for
+    // parallel rasterization.
     void Run(
         const float maxError,
         const int maxTriangles,
-        const int maxPoints);
+        const int maxPoints,
+        const int batchSize = 1);
 
     int NumPoints() const {
         return m_Points.size();
@@ -30,6 +42,13 @@ public:
     std::vector<glm::ivec3> Triangles() const;
 
 private:
+    // A triangle in the queue, with its error alongside so comparisons don't
+    // have to look it up.
+    struct QueueEntry {
+        float error;
+        int triangle;
+    };
+
     void Flush();
 
     void Step();
@@ -63,7 +82,8 @@ private:
     std::vector<float> m_Errors;
     std::vector<int> m_QueueIndexes;
 
-    std::vector<int> m_Queue;
+    int m_QueueLog2Arity;
+    std::vector<QueueEntry> m_Queue;
 
     std::vector<int> m_Pending;
 };
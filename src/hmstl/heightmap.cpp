@@ -1,10 +1,27 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
+#include <cassert>
 #include <cmath>
 
 #include "heightmap.hpp"
 #include "src/common/heightmap_data.hpp"
 
+static void ScanRange(const float *data, const uint64_t size, float *min, float *max) {
+  for (uint64_t k = 0; k < size; k++) {
+    const float datum = data[k];
+    if (std::isnan(datum)) {
+        continue;
+    }
+    if (datum < *min) {
+      *min = datum;
+    }
+    if (datum > *max) {
+      *max = datum;
+    }
+  }
+}
+
 void ScanHeightmap(Heightmap *hm) {
   if (hm == NULL) {
     fprintf(stderr, "heightmap is null\n");
@@ -12,36 +29,165 @@ void ScanHeightmap(Heightmap *hm) {
     return;
   }
 
-  float min = 1e22f;
-  float max = -1e22f;
+  hm->min = 1e22f;
+  hm->max = -1e22f;
+  ScanRange(hm->data, hm->size, &hm->min, &hm->max);
+}
 
-  for (const float datum : hm->data) {
-    if (std::isnan(datum)) {
-        continue;
-    }
-    if (datum < min) {
-      min = datum;
+void ReadHeightmap(const std::string &path, const uint32_t level, const HeightmapWindow &window,
+                   Heightmap * const hm) {
+  if (level == 0 && IsTiledHeightmap(path)) {
+    if (!IsWholeHeightmap(window)) {
+      fprintf(stderr, "Windowed reads of tiled heightmaps aren't supported, use the .dat\n");
+      std::exit(1);
     }
-    if (datum > max) {
-      max = datum;
+    hm->tiled = std::make_shared<TiledHeightmap>(path, 0);
+    hm->data = NULL;
+    hm->width = (uint32_t)hm->tiled->Width();
+    hm->height = (uint32_t)hm->tiled->Height();
+    hm->size = hm->tiled->Size();
+    hm->min = hm->tiled->Min();
+    hm->max = hm->tiled->Max();
+    return;
+  }
+
+  if (level == 0 && IsHeightmapMosaic(path)) {
+    hm->mosaic = std::make_shared<HeightmapMosaic>(path);
+    if (IsWholeHeightmap(window)) {
+      hm->data = NULL;
+      hm->width = (uint32_t)hm->mosaic->Width();
+      hm->height = (uint32_t)hm->mosaic->Height();
+      hm->size = hm->mosaic->Size();
+      hm->mosaic->Range(&hm->min, &hm->max);
+      return;
     }
+    // only the tiles under the window are mapped
+    auto samples = std::make_shared<std::vector<float> >();
+    int32_t width, height;
+    hm->mosaic->ReadWindow(window, &width, &height, samples.get());
+    hm->samples = samples;
+    hm->data = samples->data();
+    hm->width = (uint32_t)width;
+    hm->height = (uint32_t)height;
+    hm->size = samples->size();
+    ScanHeightmap(hm);
+    return;
   }
 
-  hm->min = min;
-  hm->max = max;
-}
+  if (!IsWholeHeightmap(window)) {
+    const HeightmapView view(path, level, PyramidPlane::kMean, HeightmapView::Access::kRandom);
+    auto samples = std::make_shared<std::vector<float> >();
+    int32_t width, height;
+    ReadHeightmapWindow(view, window, &width, &height, samples.get());
+    hm->samples = samples;
+    hm->data = samples->data();
+    hm->width = (uint32_t)width;
+    hm->height = (uint32_t)height;
+    hm->size = samples->size();
+    ScanHeightmap(hm);
+    return;
+  }
 
-void ReadHeightmap(const std::string &path, Heightmap * const hm) {
-  int32_t width, height;
-  ReadHeightmapData(path, &width, &height, &(hm->data));
+  hm->view = std::make_shared<const HeightmapView>(path, level, PyramidPlane::kMean, HeightmapView::Access::kSequential);
+  hm->data = hm->view->Data();
 
-  hm->width = (uint32_t)width;
-  hm->height = (uint32_t)height;
-  hm->size = (uint64_t)width * (uint64_t)height;
+  hm->width = (uint32_t)hm->view->Width();
+  hm->height = (uint32_t)hm->view->Height();
+  hm->size = hm->view->Size();
 
   ScanHeightmap(hm);
 }
 
+void StreamHeightmap(const char *path, const bool scan, Heightmap * const hm) {
+  // tiled heightmaps and mosaics are always read a band at a time
+  if (path != NULL && (IsTiledHeightmap(path) || IsHeightmapMosaic(path))) {
+    ReadHeightmap(path, 0, kWholeHeightmap, hm);
+    return;
+  }
+
+  hm->stream = std::make_shared<HeightmapStream>(path);
+  hm->data = NULL;
+
+  hm->width = (uint32_t)hm->stream->Width();
+  hm->height = (uint32_t)hm->stream->Height();
+  hm->size = hm->stream->Size();
+
+  if (!scan) {
+    return;
+  }
+  // Make sure we can come back before consuming the input.
+  if (!hm->stream->Rewind()) {
+    fprintf(stderr, "Can't rescan a heightmap from a pipe. Use -r to give the height range.\n");
+    std::exit(1);
+  }
+
+  // Pre-pass for min/max, one band at a time.
+  const uint32_t band_rows = 64;
+  std::vector<float> band((uint64_t)band_rows * hm->width);
+  hm->min = 1e22f;
+  hm->max = -1e22f;
+  for (uint32_t y = 0; y < hm->height; y += band_rows) {
+    const uint32_t num_rows = std::min(band_rows, hm->height - y);
+    hm->stream->ReadRows(band.data(), num_rows);
+    ScanRange(band.data(), (uint64_t)num_rows * hm->width, &hm->min, &hm->max);
+  }
+  if (!hm->stream->Rewind()) {
+    fprintf(stderr, "Failed to rewind the heightmap stream\n");
+    std::exit(1);
+  }
+}
+
+HeightmapRows::HeightmapRows(const Heightmap &hm, const uint32_t band_rows) :
+    hm_(hm),
+    capacity_(band_rows + 2),
+    rows_read_(0) {
+  if (hm_.data == NULL) {
+    ring_.resize((uint64_t)capacity_ * hm_.width);
+  }
+}
+
+void HeightmapRows::Advance(const uint32_t y) {
+  if (hm_.data != NULL) {
+    return;
+  }
+  // Rows are read a band at a time, so y+1 is usually already there.
+  // The ring holds band_rows + 2 rows, which leaves y-1 untouched.
+  const uint32_t last = std::min(y + 1, hm_.height - 1);
+  while (rows_read_ <= last) {
+    ReadBand();
+  }
+}
+
+void HeightmapRows::ReadBand() {
+  const uint32_t num_rows = std::min(capacity_ - 2, hm_.height - rows_read_);
+  // The band may wrap around the end of the ring.
+  const uint32_t slot = rows_read_ % capacity_;
+  const uint32_t first = std::min(num_rows, capacity_ - slot);
+  ReadRows(&ring_[(uint64_t)slot * hm_.width], first);
+  if (first < num_rows) {
+    ReadRows(ring_.data(), num_rows - first);
+  }
+}
+
+void HeightmapRows::ReadRows(float *dst, const uint32_t num_rows) {
+  if (hm_.tiled) {
+    hm_.tiled->ReadRows(rows_read_, num_rows, dst);
+  } else if (hm_.mosaic) {
+    hm_.mosaic->ReadRows(rows_read_, num_rows, dst);
+  } else {
+    hm_.stream->ReadRows(dst, num_rows);
+  }
+  rows_read_ += num_rows;
+}
+
+const float *HeightmapRows::Row(const uint32_t y) const {
+  if (hm_.data != NULL) {
+    return hm_.data + (uint64_t)y * hm_.width;
+  }
+  assert(y < rows_read_ && y + capacity_ >= rows_read_);
+  return &ring_[(uint64_t)(y % capacity_) * hm_.width];
+}
+
 void DumpHeightmap(const Heightmap &hm) {
   fprintf(stderr, "Width: %u\n", hm.width);
   fprintf(stderr, "Height: %u\n", hm.height);
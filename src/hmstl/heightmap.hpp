@@ -1,8 +1,13 @@
 #pragma once
 
 #include <inttypes.h>
-#include <vector>
+#include <memory>
 #include <string>
+#include <vector>
+
+#include "src/common/heightmap_data.hpp"
+#include "src/common/heightmap_mosaic.hpp"
+#include "src/common/tiled_heightmap.hpp"
 
 typedef struct {
   // xy dimensions (size = width * height)
@@ -13,9 +18,54 @@ typedef struct {
   float min, max;
 
   // raster with size pixels ranging in value from min to max
-  std::vector<float> data;
+  // (NULL when streaming, use HeightmapRows instead)
+  const float *data;
+
+  // memory mapping which owns data
+  std::shared_ptr<const HeightmapView> view;
+
+  // samples which own data, for windowed reads
+  std::shared_ptr<const std::vector<float> > samples;
+
+  // row stream, if the heightmap isn't mapped
+  std::shared_ptr<HeightmapStream> stream;
+
+  // tile reader, if the input is a tiled heightmap
+  std::shared_ptr<TiledHeightmap> tiled;
+
+  // tile files, if the input is a mosaic manifest
+  std::shared_ptr<HeightmapMosaic> mosaic;
 
 } Heightmap;
 
-void ReadHeightmap(const std::string &path, Heightmap * const hm);
+// Window of rows around the row being meshed, either pointing into the mapped
+// raster or held in a ring buffer refilled from the stream (or tiles) a band at a time.
+class HeightmapRows {
+public:
+  HeightmapRows(const Heightmap &hm, const uint32_t band_rows);
+
+  // Make rows y-1, y and y+1 available. Rows must be advanced in increasing order.
+  void Advance(const uint32_t y);
+
+  const float *Row(const uint32_t y) const;
+
+private:
+  void ReadBand();
+  void ReadRows(float *dst, const uint32_t num_rows);
+
+  const Heightmap &hm_;
+  uint32_t capacity_;
+  uint32_t rows_read_;
+  std::vector<float> ring_;
+};
+
+// Map a .dat heightmap, or open a tiled one (whose min/max come from its header)
+// or a mosaic (whose tiles are mapped as rows reach them).
+// A level above 0 maps that level of the pyramid sidecar instead, and a window
+// other than kWholeHeightmap copies out just that (decimated) window of it.
+void ReadHeightmap(const std::string &path, const uint32_t level, const HeightmapWindow &window,
+                   Heightmap * const hm);
+// Open path (stdin if NULL) for streaming. If scan is true the min/max are found
+// with a pre-pass, which fails on inputs that can't be rewound.
+void StreamHeightmap(const char *path, const bool scan, Heightmap * const hm);
 void DumpHeightmap(const Heightmap &hm);
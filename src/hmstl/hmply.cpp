@@ -1,18 +1,35 @@
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 #include <chrono>
-#include <unordered_map>
+#include <memory>
+#include <string>
+#include <vector>
 #include <glm/glm.hpp>
 
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
 #include "heightmap.hpp"
+#include "outline.hpp"
 #include "parse_args.hpp"
-#include "src/common/hash.hpp"
+#include "src/common/parallel.hpp"
 #include "src/common/ply.hpp"
+#include "src/common/stl.hpp"
 
 #define TRIX_FACE_MAX 4294967295U
 
+// Rows read per band when streaming the heightmap.
+static constexpr uint32_t kStreamBandRows = 64;
+
+// Fewest rows meshed per thread.
+static constexpr uint64_t kMinBandRows = 32;
+
 struct Scale {
   bool generate_base;
+  // with generate_base, one polygon for the bottom and a wall per straight run of outline
+  bool merge_base;
   float x_scale;
   float y_scale;
   float z_scale;
@@ -25,6 +42,7 @@ static Scale ComputeScale(const Settings &config, const Heightmap &hm) {
 
   Scale scale;
   scale.generate_base = config.generate_base;
+  scale.merge_base = config.generate_base && config.merge_base;
   // if xy size is specified, compute scale to be applied to each xyz point
   const float max_height_width = (float)std::max(hm.height, hm.width);
   const float xyz_scale = config.xy_size <= 0 ? 1 : config.xy_size / max_height_width;
@@ -46,126 +64,302 @@ static Scale ComputeScale(const Settings &config, const Heightmap &hm) {
   return scale;
 }
 
-struct triangle_t {
-  glm::vec3 a;
-  glm::vec3 b;
-  glm::vec3 c;
+// Pixels [x0, x1) x [y0, y1) of the heightmap, meshed as a piece of their own: walls
+// and base close it off along its edges, but corner heights still average the
+// pixels across them, so neighbouring tiles share their seam vertices exactly.
+struct TileRect {
+  uint32_t x0;
+  uint32_t y0;
+  uint32_t x1;
+  uint32_t y1;
+
+  uint32_t Width() const { return x1 - x0; }
+  uint32_t Height() const { return y1 - y0; }
 };
 
-using vertex_map_t = std::unordered_map<glm::vec3, uint32_t>;
-
-static inline float LookupIndex(const Heightmap &hm, uint32_t x, uint32_t y) {
-  return hm.data[(uint64_t)y * hm.width + (uint64_t)x];
+static TileRect WholeHeightmap(const Heightmap &hm) {
+  return {0, 0, hm.width, hm.height};
 }
 
+// Lattice slots hold the index of the vertex at a pixel corner, or kNoVertex.
+static constexpr uint32_t kNoVertex = UINT32_MAX;
+
+// A pixel corner, with the slots of its surface vertex and of the z = 0 base vertex below it.
+struct Corner {
+  glm::vec3 v;
+  uint32_t *slot;
+  uint32_t *base_slot;
+};
+
+struct triangle_t {
+  Corner a;
+  Corner b;
+  Corner c;
+};
+
+// Vertices written so far. Every vertex sits on a pixel corner, so instead of hashing
+// coordinates each corner of the two lattice lines bordering the row being meshed has
+// a slot holding its index. Line y runs along the top of row y with a corner at x - 0.5
+// for x in [0, width]; nothing above line y can be shared with later rows. Slots are
+// numbered from the left edge of the tile being meshed.
+struct VertexIndex {
+  // [0] is the top line of the current row and [1] its bottom line
+  std::vector<uint32_t> surface[2];
+  std::vector<uint32_t> base[2];
+  uint32_t count;
+};
+
 // If a mask is defined, only portions of the heightmap that are visible through the mask are output.
 // Bright areas of the mask image are considered transparent and dark areas are considered opaque.
-static inline bool Masked(const Heightmap &hm, uint32_t x, uint32_t y) {
-  return std::isnan(LookupIndex(hm, x, y));
+static inline bool Masked(const float *row, uint32_t x) {
+  return std::isnan(row[x]);
 }
 
+// With -o the heightmap is meshed twice: once to count the vertices and triangles
+// so the output can be sized, then again to write them straight into it.
+// Without -o there's one kWrite pass into header.dat, vertices.dat and triangles.dat.
 enum class Pass {
   kCountVerticesAndTriangles,
-  kVertexList,
-  kTriangleList
+  kWrite
 };
 
-static void WriteTriangle(FILE * const vertex_output,
-                          FILE * const triangle_output,
-                          vertex_map_t *const vmap,
-                          uint32_t *const triangle_count,
-                          const triangle_t &triangle) {
-  const glm::vec3 vertices[3] = {triangle.a, triangle.b, triangle.c};
+// A surface vertex on the outline of the unmasked pixels, at corner cx of its lattice line.
+struct OutlineVertex {
+  uint32_t cx;
+  uint32_t index;
+  float z;
+};
 
-  if (*triangle_count == TRIX_FACE_MAX) {
-    fprintf(stderr, "Too many triangles!!!\n");
-    exit(1);
+// Where the mesher puts vertices and triangles.
+struct MeshOutput {
+  Pass pass;
+  // single file output, or NULL to write the two .dat files
+  PlyWriter *writer;
+  // STL output instead, triangle by triangle
+  StlWriter *stl;
+  FILE *vertex_file;
+  FILE *triangle_file;
+  // counts from the counting pass, which the writing pass must not exceed
+  uint32_t vertex_capacity;
+  uint32_t triangle_capacity;
+
+  VertexIndex vindex;
+  uint32_t triangle_count;
+
+  // With a merged base, the pass that sees each row first fills in mask, and
+  // the writing pass records each lattice line's outline vertices in outline.
+  PixelMask *mask;
+  std::vector<std::vector<OutlineVertex> > *outline;
+};
+
+// Write vertex k, which is the next one in vertices.dat if there's no writer.
+// STL output has no separate vertices.
+static void PutVertex(MeshOutput *const output, const uint32_t k, const glm::vec3 &vertex) {
+  if (output->stl != NULL) {
+    return;
+  } else if (output->writer == NULL) {
+    WriteVertex(output->vertex_file, vertex);
+  } else if (k < output->vertex_capacity) {
+    output->writer->Vertices()[k] = vertex;
   }
-  (*triangle_count)++;
+}
 
-  // Write triangle header.
-  WriteTriangleHeader(triangle_output);
+// Write triangle k, which is the next one in triangles.dat or the STL if there's no
+// writer. STL triangles are written from the vertices rather than face's indices.
+static void PutTriangle(MeshOutput *const output, const uint32_t k, const glm::ivec3 &face, const glm::vec3 (&vertices)[3]) {
+  if (output->stl != NULL) {
+    output->stl->Write(vertices[0], vertices[1], vertices[2]);
+  } else if (output->writer == NULL) {
+    WriteTriangleHeader(output->triangle_file);
+    for (int j = 0; j < 3; j++) {
+      WriteVertexIndex(output->triangle_file, (uint32_t)face[j]);
+    }
+  } else if (k < output->triangle_capacity) {
+    output->writer->SetTriangle(k, face);
+  }
+}
 
-  // Add each vertex to the hashmap if it doesn't exist.
-  for (const glm::vec3 &vertex : vertices) {
-    auto search = vmap->find(vertex);
-    uint32_t vertex_index = 0;
-    if (search == vmap->end()) {
-      // This is a new vertex, write it to the vertex output and insert it to the hashmap.
+static void WriteTriangle(MeshOutput *const output, const triangle_t &triangle) {
+  const Corner vertices[3] = {triangle.a, triangle.b, triangle.c};
+
+  if (output->triangle_count == TRIX_FACE_MAX) {
+    fprintf(stderr, "Too many triangles!!!\n");
+    exit(1);
+  }
+  const uint32_t triangle_index = output->triangle_count++;
+
+  // Give each vertex an index if its corner doesn't have one yet.
+  // A surface vertex at z = 0 is the same vertex as the base one below it.
+  VertexIndex *const vindex = &output->vindex;
+  glm::ivec3 face;
+  const glm::vec3 positions[3] = {triangle.a.v, triangle.b.v, triangle.c.v};
+  for (int k = 0; k < 3; k++) {
+    const glm::vec3 &vertex = vertices[k].v;
+    uint32_t *const slot = vertex.z == 0 ? vertices[k].base_slot : vertices[k].slot;
+    uint32_t vertex_index = *slot;
+    if (vertex_index == kNoVertex) {
+      // This is a new vertex, write it to the vertex output and record it in its slot.
       // Check for size limit.
-      if (vmap->size() == (size_t)TRIX_FACE_MAX) {
+      if (vindex->count == TRIX_FACE_MAX) {
         fprintf(stderr, "Too many vertices!!!\n");
         exit(1);
       }
 
-      // Write this new vertex to file.
-      WriteVertex(vertex_output, vertex);
+      vertex_index = vindex->count++;
+      *slot = vertex_index;
 
-      // Insert vertex into hashmap
-      vertex_index = static_cast<uint32_t>(vmap->size());
-      vmap->insert({vertex, vertex_index});
-    } else {
-      vertex_index = search->second;
+      // Write this new vertex to file.
+      if (output->pass == Pass::kWrite) {
+        PutVertex(output, vertex_index, vertex);
+      }
     }
+    face[k] = (int)vertex_index;
+  }
 
-    // write the vertex index to the triangle file
-    WriteVertexIndex(triangle_output, vertex_index);
+  if (output->pass == Pass::kWrite) {
+    PutTriangle(output, triangle_index, face, positions);
   }
 }
 
-static void Wall(FILE * const vertex_output,
-                 FILE * const triangle_output,
-                 vertex_map_t *const vmap,
-                 uint32_t * const triangle_count,
-                 const glm::vec3 &a,
-                 const glm::vec3 &b) {
-  glm::vec3 a0 = a;
-  glm::vec3 b0 = b;
+// The base vertex below a corner.
+static inline Corner Base(const Corner &corner) {
+  Corner base = corner;
+  base.v.z = 0;
+  base.slot = corner.base_slot;
+  return base;
+}
+
+static void Wall(MeshOutput *const output,
+                 const Corner &a,
+                 const Corner &b) {
+  const Corner a0 = Base(a);
+  const Corner b0 = Base(b);
   triangle_t t1;
   triangle_t t2;
-  a0.z = 0;
-  b0.z = 0;
   t1.a = a;
   t1.b = b;
   t1.c = b0;
   t2.a = b0;
   t2.b = a0;
   t2.c = a;
-  WriteTriangle(vertex_output, triangle_output, vmap, triangle_count, t1);
-  WriteTriangle(vertex_output, triangle_output, vmap, triangle_count, t2);
+  WriteTriangle(output, t1);
+  WriteTriangle(output, t2);
 }
 
-// returns average of all non-negative arguments.
-// If any argument is negative, it is not included in the average.
-// argument zp will always be nonnegative.
-static float avgnonneg(const float z0, const float z1, const float z2, const float z3) {
-  float sum = 0;
-  const float z[4] = {z0, z1, z2, z3};
-  int32_t n = 0;
-  for (int32_t i = 0; i < 4; i++) {
-    if (z[i] >= 0) {
-      sum += z[i];
-      n++;
-    }
+static inline float hmzat(const float *row, uint32_t x, const Scale &scale) {
+  return scale.z_offset + scale.z_scale * row[x];
+}
+
+/*
+
+  +---+---+---+
+  |   |   |   |
+  | A | B | C |
+  |   |   |   |
+  +---1---2---+
+  |   |I /|   |
+  | H | P | D |
+  |   |/ J|   |
+  +---4---3---+
+  |   |   |   |
+  | G | F | E |
+  |   |   |   |
+  +---+---+---+
+
+  Current pixel position is marked at center as P.
+  This pixel is output as two triangles, I and J.
+  Points 1, 2, 3, and 4 are offset half a unit from P.
+  Neighboring pixels are A, B, C, D, E, F, G, and H.
+
+  Vertex 1 z is average of ABPH z
+  Vertex 2 z is average of BCDP z
+  Vertex 3 z is average of PDEF z
+  Vertex 4 z is average of HPFG z
+
+  Averages do not include neighbors that would lie
+  outside the image, but do included masked values.
+
+  Every corner is the average of the pixels above-left, above-right, below-right
+  and below-left of it, in that order, so each corner's height is computed once
+  per lattice line rather than by each of the pixels that share it.
+
+*/
+
+// Scaled heights of the tile's part of a row and the pixel either side of it, with -1
+// to flag pixels past the edges of the heightmap, or all -1 for a row past the top or
+// bottom. dst holds rect.Width() + 2 heights.
+static void PadRow(const float *row, const uint32_t width, const TileRect &rect, const Scale &scale, float *dst) {
+  const uint32_t n = rect.Width();
+  dst[0] = row == NULL || rect.x0 == 0 ? -1 : hmzat(row, rect.x0 - 1, scale);
+  dst[n + 1] = row == NULL || rect.x1 == width ? -1 : hmzat(row, rect.x1, scale);
+  for (uint32_t x = 0; x < n; x++) {
+    dst[x + 1] = row == NULL ? -1 : hmzat(row, rect.x0 + x, scale);
   }
+}
 
-  assert(n > 0);
-  return sum / (float)n;
+// Corner heights of the lattice line between two padded rows: the average of the
+// non-negative heights around each corner. Masked (NaN) and edge (-1) heights fail
+// the >= 0 test and are left out, and adding 0 in their place leaves the sum exact.
+// dst holds width + 1 heights.
+static void CornerHeights(const float *above, const float *below, const uint32_t width, float *dst) {
+  uint32_t c = 0;
+#if defined(__SSE2__)
+  const __m128 zero = _mm_setzero_ps();
+  const __m128 one = _mm_set1_ps(1);
+  for (; c + 4 <= width + 1; c += 4) {
+    const __m128 z[4] = {_mm_loadu_ps(above + c), _mm_loadu_ps(above + c + 1),
+                         _mm_loadu_ps(below + c + 1), _mm_loadu_ps(below + c)};
+    __m128 sum = zero;
+    __m128 n = zero;
+    for (const __m128 &zk : z) {
+      const __m128 valid = _mm_cmpge_ps(zk, zero);
+      sum = _mm_add_ps(sum, _mm_and_ps(valid, zk));
+      n = _mm_add_ps(n, _mm_and_ps(valid, one));
+    }
+    _mm_storeu_ps(dst + c, _mm_div_ps(sum, n));
+  }
+#endif
+  for (; c <= width; c++) {
+    const float z[4] = {above[c], above[c + 1], below[c + 1], below[c]};
+    float sum = 0;
+    float n = 0;
+    for (const float zk : z) {
+      if (zk >= 0) {
+        sum += zk;
+        n += 1;
+      }
+    }
+    dst[c] = sum / n;
+  }
 }
 
-static inline float hmzat(const Heightmap &hm, uint32_t x, uint32_t y, const Scale &scale) {
-  return scale.z_offset + scale.z_scale * LookupIndex(hm, x, y);
+// Heights of the rows around the one being meshed and of the corners between them,
+// rolled down a row at a time so each is computed once.
+struct RowCache {
+  // padded heights (see PadRow) of the row being meshed and the one below it
+  std::vector<float> row;
+  std::vector<float> below;
+  // corner heights of the lattice lines above and below the row being meshed
+  std::vector<float> top;
+  std::vector<float> bottom;
+  // scaled x of each corner
+  std::vector<float> corner_x;
+};
+
+// Once a row is meshed, its bottom line becomes the top line of the next one.
+static void NextLatticeLine(VertexIndex *const vindex) {
+  for (std::vector<uint32_t> *slots : {vindex->surface, vindex->base}) {
+    std::swap(slots[0], slots[1]);
+    std::fill(slots[1].begin(), slots[1].end(), kNoVertex);
+  }
 }
 
 // given four vertices and a mesh, add two triangles representing the quad with given corners
-static void Surface(FILE * const vertex_output,
-                    FILE * const triangle_output,
-                    vertex_map_t *const vmap,
-                    uint32_t * const triangle_count,
-                    const glm::vec3 &v1,
-                    const glm::vec3 &v2,
-                    const glm::vec3 &v3,
-                    const glm::vec3 &v4) {
+static void Surface(MeshOutput *const output,
+                    const Corner &v1,
+                    const Corner &v2,
+                    const Corner &v3,
+                    const Corner &v4) {
   triangle_t i, j;
 
   i.a = v4;
@@ -176,202 +370,399 @@ static void Surface(FILE * const vertex_output,
   j.b = v3;
   j.c = v2;
 
-  WriteTriangle(vertex_output, triangle_output, vmap, triangle_count, i);
-  WriteTriangle(vertex_output, triangle_output, vmap, triangle_count, j);
+  WriteTriangle(output, i);
+  WriteTriangle(output, j);
 }
 
-static void Mesh(const Heightmap &hm,
-                 FILE *const vertex_output,
-                 FILE *const triangle_output,
-                 vertex_map_t * const vmap,
-                 uint32_t * const triangle_count,
-                 const Scale &scale) {
-  uint32_t x, y;
-  float az, bz, cz, dz, ez, fz, gz, hz;
-  glm::vec3 vp, v1, v2, v3, v4;
-
-  for (y = 0; y < hm.height; y++) {
-    for (x = 0; x < hm.width; x++) {
-
-      if (Masked(hm, x, y)) {
-        continue;
-      }
+// Per-row counts from the counting pass, and their prefix sums: the index of each
+// row's first vertex and triangle, with the totals at [height]. Rows are numbered
+// from the top of the tile being meshed.
+struct RowCounts {
+  std::vector<uint32_t> vertices;
+  std::vector<uint32_t> triangles;
+  std::vector<uint64_t> first_vertex;
+  std::vector<uint64_t> first_triangle;
+};
 
-      /*
-
-        +---+---+---+
-        |   |   |   |
-        | A | B | C |
-        |   |   |   |
-        +---1---2---+
-        |   |I /|   |
-        | H | P | D |
-        |   |/ J|   |
-        +---4---3---+
-        |   |   |   |
-        | G | F | E |
-        |   |   |   |
-        +---+---+---+
-
-        Current pixel position is marked at center as P.
-        This pixel is output as two triangles, I and J.
-        Points 1, 2, 3, and 4 are offset half a unit from P.
-        Neighboring pixels are A, B, C, D, E, F, G, and H.
-
-        Vertex 1 z is average of ABPH z
-        Vertex 2 z is average of BCDP z
-        Vertex 3 z is average of PDEF z
-        Vertex 4 z is average of HPFG z
-
-        Averages do not include neighbors that would lie
-        outside the image, but do included masked values.
-
-      */
-
-      // determine elevation of neighboring pixels in order to
-      // to interpolate height of corners 1, 2, 3, and 4.
-      // -1 is used to flag edge pixels to disregard.
-      // (Masked neighbors are still considered.)
-
-      if (x == 0 || y == 0) {
-        az = -1;
-      } else {
-        az = hmzat(hm, x - 1, y - 1, scale);
-      }
+// Mesh pixel (x, y) from the cached corner heights. Interior pixels (kBorder false)
+// have all eight neighbours in the tile, so the edge tests drop out.
+template <bool kGenerateBase, bool kBorder>
+static inline void MeshPixel(const TileRect &rect,
+                             const float *const above,
+                             const float *const row,
+                             const float *const below,
+                             const uint32_t x,
+                             const uint32_t y,
+                             const RowCache &cache,
+                             const float top_y,
+                             const float bottom_y,
+                             MeshOutput *const output) {
+  if (Masked(row, x)) {
+    return;
+  }
 
-      if (y == 0) {
-        bz = -1;
-      } else {
-        bz = hmzat(hm, x, y - 1, scale);
-      }
+  VertexIndex *const vindex = &output->vindex;
+  const uint32_t c = x - rect.x0;
+  const Corner c1 = {{cache.corner_x[c], top_y, cache.top[c]}, &vindex->surface[0][c], &vindex->base[0][c]};
+  const Corner c2 = {{cache.corner_x[c + 1], top_y, cache.top[c + 1]}, &vindex->surface[0][c + 1], &vindex->base[0][c + 1]};
+  const Corner c3 = {{cache.corner_x[c + 1], bottom_y, cache.bottom[c + 1]}, &vindex->surface[1][c + 1], &vindex->base[1][c + 1]};
+  const Corner c4 = {{cache.corner_x[c], bottom_y, cache.bottom[c]}, &vindex->surface[1][c], &vindex->base[1][c]};
 
-      if (y == 0 || x + 1 == hm.width) {
-        cz = -1;
-      } else {
-        cz = hmzat(hm, x + 1, y - 1, scale);
-      }
+  // Upper surface
+  Surface(output, c1, c2, c3, c4);
 
-      if (x + 1 == hm.width) {
-        dz = -1;
-      } else {
-        dz = hmzat(hm, x + 1, y, scale);
-      }
+  // nothing left to do for this pixel unless we need to make walls
+  if (!kGenerateBase) {
+    return;
+  }
 
-      if (x + 1 == hm.width || y + 1 == hm.height) {
-        ez = -1;
-      } else {
-        ez = hmzat(hm, x + 1, y + 1, scale);
-      }
+  // north wall (vertex 1 to 2)
+  if ((kBorder && y == rect.y0) || Masked(above, x)) {
+    Wall(output, c1, c2);
+  }
 
-      if (y + 1 == hm.height) {
-        fz = -1;
-      } else {
-        fz = hmzat(hm, x, y + 1, scale);
-      }
+  // east wall (vertex 2 to 3)
+  if ((kBorder && x + 1 == rect.x1) || Masked(row, x + 1)) {
+    Wall(output, c2, c3);
+  }
 
-      if (y + 1 == hm.height || x == 0) {
-        gz = -1;
-      } else {
-        gz = hmzat(hm, x - 1, y + 1, scale);
-      }
+  // south wall (vertex 3 to 4)
+  if ((kBorder && y + 1 == rect.y1) || Masked(below, x)) {
+    Wall(output, c3, c4);
+  }
 
-      if (x == 0) {
-        hz = -1;
-      } else {
-        hz = hmzat(hm, x - 1, y, scale);
-      }
+  // west wall (vertex 4 to 1)
+  if ((kBorder && x == rect.x0) || Masked(row, x - 1)) {
+    Wall(output, c4, c1);
+  }
 
-      // pixel vertex
-      vp.x = (float)x;
-      vp.y = (float)(hm.height - y);
-      vp.z = hmzat(hm, x, y, scale);
-
-      // Vertex 1
-      v1.x = (float)x - 0.5f;
-      v1.y = ((float)hm.height - ((float)y - 0.5f));
-      v1.z = avgnonneg(az, bz, vp.z, hz);
-      // Vertex 2
-      v2.x = (float)x + 0.5f;
-      v2.y = v1.y;
-      v2.z = avgnonneg(bz, cz, dz, vp.z);
-
-      // Vertex 3
-      v3.x = v2.x;
-      v3.y = ((float)hm.height - ((float)y + 0.5f));
-      v3.z = avgnonneg(vp.z, dz, ez, fz);
-
-      // Vertex 4
-      v4.x = v1.x;
-      v4.y = v3.y;
-      v4.z = avgnonneg(hz, vp.z, fz, gz);
-
-      // Scale XY coordinates.
-      for (glm::vec3 *vert : {&vp, &v1, &v2, &v3, &v4}) {
-        vert->x *= scale.x_scale;
-        vert->y *= scale.y_scale;
-      }
+  // bottom surface - same as top, except with z = 0 and reverse winding
+  Surface(output, Base(c4), Base(c3), Base(c2), Base(c1));
+}
 
-      // Upper surface
-      Surface(vertex_output, triangle_output, vmap, triangle_count, v1, v2, v3, v4);
+// Mesh the tile's part of row y, given it and its neighbours (NULL past the edges).
+template <bool kGenerateBase>
+static void MeshRow(const Heightmap &hm,
+                    const TileRect &rect,
+                    const float *const above,
+                    const float *const row,
+                    const float *const below,
+                    const uint32_t y,
+                    const RowCache &cache,
+                    const Scale &scale,
+                    MeshOutput *const output) {
+  const float top_y = ((float)hm.height - ((float)y - 0.5f)) * scale.y_scale;
+  const float bottom_y = ((float)hm.height - ((float)y + 0.5f)) * scale.y_scale;
+
+  if (y == rect.y0 || y + 1 == rect.y1 || rect.Width() < 3) {
+    for (uint32_t x = rect.x0; x < rect.x1; x++) {
+      MeshPixel<kGenerateBase, true>(rect, above, row, below, x, y, cache, top_y, bottom_y, output);
+    }
+  } else {
+    MeshPixel<kGenerateBase, true>(rect, above, row, below, rect.x0, y, cache, top_y, bottom_y, output);
+    for (uint32_t x = rect.x0 + 1; x + 1 < rect.x1; x++) {
+      MeshPixel<kGenerateBase, false>(rect, above, row, below, x, y, cache, top_y, bottom_y, output);
+    }
+    MeshPixel<kGenerateBase, true>(rect, above, row, below, rect.x1 - 1, y, cache, top_y, bottom_y, output);
+  }
+}
 
-      // nothing left to do for this pixel unless we need to make walls
-      if (!scale.generate_base) {
-        continue;
-      }
+// Record the vertices of the lattice line between rows above and below (NULL past
+// the edges of the tile) that have a masked pixel or the edge on one side, which are
+// all the ones the outline can pass through. side picks the line's slots and heights
+// in vindex and the row cache: 0 for the top line of the row just meshed, 1 for its bottom.
+static void RecordOutlineLine(const float *const above,
+                              const float *const below,
+                              const TileRect &rect,
+                              const VertexIndex &vindex,
+                              const int side,
+                              const std::vector<float> &heights,
+                              std::vector<OutlineVertex> *vertices) {
+  vertices->clear();
+  const uint32_t width = rect.Width();
+  for (uint32_t cx = 0; cx <= width; cx++) {
+    const float z = heights[cx];
+    const uint32_t index = z == 0 ? vindex.base[side][cx] : vindex.surface[side][cx];
+    const uint32_t x = rect.x0 + cx;
+    const bool inside = cx > 0 && cx < width && above != NULL && below != NULL &&
+                        !Masked(above, x - 1) && !Masked(above, x) &&
+                        !Masked(below, x - 1) && !Masked(below, x);
+    if (index != kNoVertex && !inside) {
+      vertices->push_back({cx, index, z});
+    }
+  }
+}
 
-      // north wall (vertex 1 to 2)
-      if (y == 0 || Masked(hm, x, y - 1)) {
-        Wall(vertex_output, triangle_output, vmap, triangle_count, v1, v2);
-      }
+// Mesh the tile's part of rows [y0, y1).
+//
+// Vertices are numbered in order of first use, so a band needs the indices already
+// given to the corners of its top line. Those only depend on the two rows above it,
+// which are replayed without writing: row y0 - 2 finds which corners of line y0 - 1
+// are taken, then row y0 - 1, numbered from its first vertex, fills in line y0.
+// The counting pass records each row's counts in counts, the writing pass numbers
+// rows from their prefix sums. Without counts there's one band covering the tile.
+static void MeshBand(const Heightmap &hm,
+                     const TileRect &rect,
+                     const uint32_t y0,
+                     const uint32_t y1,
+                     const Scale &scale,
+                     RowCounts *const counts,
+                     MeshOutput *const output) {
+  HeightmapRows rows(hm, kStreamBandRows);
+  const uint32_t width = rect.Width();
+  VertexIndex *const vindex = &output->vindex;
+  for (std::vector<uint32_t> *slots : {vindex->surface, vindex->base}) {
+    slots[0].assign(width + 1, kNoVertex);
+    slots[1].assign(width + 1, kNoVertex);
+  }
+
+  RowCache cache;
+  cache.row.resize(width + 2);
+  cache.below.resize(width + 2);
+  cache.top.resize(width + 1);
+  cache.bottom.resize(width + 1);
+  cache.corner_x.resize(width + 1);
+  for (uint32_t c = 0; c <= width; c++) {
+    cache.corner_x[c] = ((float)(rect.x0 + c) - 0.5f) * scale.x_scale;
+  }
 
-      // east wall (vertex 2 to 3)
-      if (x + 1 == hm.width || Masked(hm, x + 1, y)) {
-        Wall(vertex_output, triangle_output, vmap, triangle_count, v2, v3);
+  const Pass pass = output->pass;
+  const uint32_t first_row = y0 - std::min(y0 - rect.y0, 2U);
+  for (uint32_t y = first_row; y < y1; y++) {
+    output->pass = y < y0 ? Pass::kCountVerticesAndTriangles : pass;
+    if (counts != NULL && pass == Pass::kWrite && y <= y0) {
+      output->vindex.count = (uint32_t)counts->first_vertex[y - rect.y0];
+      output->triangle_count = (uint32_t)counts->first_triangle[y - rect.y0];
+    }
+    const uint32_t vertex_count = output->vindex.count;
+    const uint32_t triangle_count = output->triangle_count;
+
+    rows.Advance(y);
+    // neighbouring rows are only dereferenced when they exist
+    const float *const above = y == 0 ? NULL : rows.Row(y - 1);
+    const float *const row = rows.Row(y);
+    const float *const below = y + 1 == hm.height ? NULL : rows.Row(y + 1);
+
+    // the heights above come down from the previous row, except for the first
+    if (y == first_row) {
+      PadRow(above, hm.width, rect, scale, cache.below.data());
+      PadRow(row, hm.width, rect, scale, cache.row.data());
+      CornerHeights(cache.below.data(), cache.row.data(), width, cache.top.data());
+    }
+    PadRow(below, hm.width, rect, scale, cache.below.data());
+    CornerHeights(cache.row.data(), cache.below.data(), width, cache.bottom.data());
+
+    if (output->mask != NULL && y >= y0) {
+      output->mask->SetRow(y - rect.y0, row + rect.x0);
+    }
+    if (scale.generate_base && !scale.merge_base) {
+      MeshRow<true>(hm, rect, above, row, below, y, cache, scale, output);
+    } else {
+      MeshRow<false>(hm, rect, above, row, below, y, cache, scale, output);
+    }
+    if (output->outline != NULL && output->pass == Pass::kWrite) {
+      const uint32_t line = y - rect.y0;
+      RecordOutlineLine(y == rect.y0 ? NULL : above, row, rect, *vindex, 0, cache.top, &(*output->outline)[line]);
+      if (y + 1 == rect.y1) {
+        RecordOutlineLine(row, NULL, rect, *vindex, 1, cache.bottom, &(*output->outline)[line + 1]);
       }
+    }
+    NextLatticeLine(vindex);
+    std::swap(cache.row, cache.below);
+    std::swap(cache.top, cache.bottom);
+
+    if (counts != NULL && pass == Pass::kCountVerticesAndTriangles && y >= y0) {
+      counts->vertices[y - rect.y0] = output->vindex.count - vertex_count;
+      counts->triangles[y - rect.y0] = output->triangle_count - triangle_count;
+    }
+  }
+  output->pass = pass;
+
+  if (counts != NULL && pass == Pass::kWrite &&
+      (output->vindex.count != counts->first_vertex[y1 - rect.y0] ||
+       output->triangle_count != counts->first_triangle[y1 - rect.y0])) {
+    fprintf(stderr, "Error: rows %u to %u gave %u vertices and %u triangles after counting %" PRIu64 " and %" PRIu64 "\n",
+            y0, y1, output->vindex.count, output->triangle_count,
+            counts->first_vertex[y1 - rect.y0], counts->first_triangle[y1 - rect.y0]);
+    exit(1);
+  }
+}
 
-      // south wall (vertex 3 to 4)
-      if (y + 1 == hm.height || Masked(hm, x, y + 1)) {
-        Wall(vertex_output, triangle_output, vmap, triangle_count, v3, v4);
+static bool IsWholeHeightmap(const Heightmap &hm, const TileRect &rect) {
+  return rect.x0 == 0 && rect.y0 == 0 && rect.x1 == hm.width && rect.y1 == hm.height;
+}
+
+// Mesh rect. With counts, a mapped heightmap is split into bands meshed in parallel
+// (see MeshBand); anything read a band at a time is meshed in one go, and so is a
+// tile, as the tiles are meshed in parallel themselves.
+static void MeshPass(const Heightmap &hm,
+                     const TileRect &rect,
+                     const Scale &scale,
+                     RowCounts *const counts,
+                     MeshOutput *const output) {
+  auto t0 = std::chrono::steady_clock::now();
+  const bool whole = IsWholeHeightmap(hm, rect);
+  const uint32_t height = rect.Height();
+  uint64_t triangle_count = 0;
+  uint64_t vertex_count = 0;
+  if (counts == NULL) {
+    MeshBand(hm, rect, rect.y0, rect.y1, scale, NULL, output);
+    triangle_count = output->triangle_count;
+    vertex_count = output->vindex.count;
+  } else {
+    const uint64_t min_band_rows = hm.data == NULL || !whole ? std::max(height, 1U) : kMinBandRows;
+    ParallelFor(height, min_band_rows, [&](const uint64_t begin, const uint64_t end) {
+      MeshOutput band = *output;
+      MeshBand(hm, rect, rect.y0 + (uint32_t)begin, rect.y0 + (uint32_t)end, scale, counts, &band);
+    });
+
+    if (output->pass == Pass::kCountVerticesAndTriangles) {
+      for (uint32_t y = 0; y < height; y++) {
+        counts->first_vertex[y + 1] = counts->first_vertex[y] + counts->vertices[y];
+        counts->first_triangle[y + 1] = counts->first_triangle[y] + counts->triangles[y];
+      }
+      if (counts->first_vertex[height] > TRIX_FACE_MAX || counts->first_triangle[height] > TRIX_FACE_MAX) {
+        fprintf(stderr, "Too many vertices or triangles!!!\n");
+        exit(1);
       }
+    }
+    triangle_count = counts->first_triangle[height];
+    vertex_count = counts->first_vertex[height];
+  }
+  // tiles are reported once they're written
+  if (whole) {
+    auto t1 = std::chrono::steady_clock::now();
+    fprintf(stderr, "Meshed in %.2f s\n", std::chrono::duration<double>(t1-t0).count());
+    fprintf(stderr, "mesh has %.2e triangles and %.2e vertices\n",
+           (double)triangle_count, (double)vertex_count);
+  }
+}
+
+// Write the merged base after the surface: its vertices, the bottom polygons, then
+// the walls between them and the surface vertices recorded along the outline.
+static void WriteMergedBase(const Heightmap &hm,
+                            const TileRect &rect,
+                            const Scale &scale,
+                            const MergedBase &base,
+                            const std::vector<std::vector<OutlineVertex> > &outline,
+                            MeshOutput *const output) {
+  // corners and lines are numbered from the tile's top left
+  const auto position = [&hm, &rect, &scale](const uint32_t cx, const uint32_t line, const float z) {
+    return glm::vec3(((float)(rect.x0 + cx) - 0.5f) * scale.x_scale,
+                     ((float)hm.height - ((float)(rect.y0 + line) - 0.5f)) * scale.y_scale,
+                     z);
+  };
+  const uint64_t corners_per_line = rect.Width() + 1;
+
+  const uint32_t first_base_vertex = output->vindex.count;
+  std::vector<glm::vec3> base_vertices;
+  base_vertices.reserve(base.corners.size());
+  for (const uint64_t corner : base.corners) {
+    base_vertices.push_back(position((uint32_t)(corner % corners_per_line), (uint32_t)(corner / corners_per_line), 0));
+    PutVertex(output, output->vindex.count++, base_vertices.back());
+  }
+  for (const glm::ivec3 &triangle : base.triangles) {
+    const glm::vec3 vertices[3] = {base_vertices[(uint64_t)triangle[0]],
+                                   base_vertices[(uint64_t)triangle[1]],
+                                   base_vertices[(uint64_t)triangle[2]]};
+    PutTriangle(output, output->triangle_count++, triangle + (int)first_base_vertex, vertices);
+  }
 
-      // west wall (vertex 4 to 1)
-      if (x == 0 || Masked(hm, x - 1, y)) {
-        Wall(vertex_output, triangle_output, vmap, triangle_count, v4, v1);
+  const auto base_vertex = [&base](const uint64_t corner) {
+    return (uint64_t)(std::lower_bound(base.corners.begin(), base.corners.end(), corner) - base.corners.begin());
+  };
+  std::vector<int> indices;
+  std::vector<glm::vec3> positions;
+  std::vector<float> heights;
+  std::vector<glm::ivec3> wall;
+  for (const OutlineRun &run : base.runs) {
+    const glm::ivec2 step = HeadingStep(run.heading);
+    indices.clear();
+    positions.clear();
+    heights.clear();
+    uint32_t cx = run.cx;
+    uint32_t line = run.line;
+    for (uint32_t k = 0; k <= run.length; k++) {
+      if (k > 0) {
+        cx = (uint32_t)((int64_t)cx + step.x);
+        line = (uint32_t)((int64_t)line + step.y);
+      }
+      const std::vector<OutlineVertex> &vertices = outline[line];
+      const auto found = std::lower_bound(vertices.begin(), vertices.end(), cx,
+                                          [](const OutlineVertex &v, const uint32_t x) { return v.cx < x; });
+      if (found == vertices.end() || found->cx != cx) {
+        fprintf(stderr, "Error: no surface vertex at outline corner (%u, %u)\n", cx, line);
+        exit(1);
       }
+      indices.push_back((int)found->index);
+      positions.push_back(position(cx, line, found->z));
+      heights.push_back(found->z);
+    }
+    // the base corners under the two ends
+    for (const uint64_t corner : {(uint64_t)run.line * corners_per_line + run.cx, (uint64_t)line * corners_per_line + cx}) {
+      const uint64_t k = base_vertex(corner);
+      indices.push_back((int)(first_base_vertex + k));
+      positions.push_back(base_vertices[k]);
+    }
 
-      // bottom surface - same as top, except with z = 0 and reverse winding
-      v1.z = 0; v2.z = 0; v3.z = 0; v4.z = 0;
-      Surface(vertex_output, triangle_output, vmap, triangle_count, v4, v3, v2, v1);
+    wall.clear();
+    TriangulateWall(heights.data(), run.length, &wall);
+    for (const glm::ivec3 &triangle : wall) {
+      const uint64_t a = (uint64_t)triangle[0];
+      const uint64_t b = (uint64_t)triangle[1];
+      const uint64_t c = (uint64_t)triangle[2];
+      const glm::vec3 vertices[3] = {positions[a], positions[b], positions[c]};
+      PutTriangle(output, output->triangle_count++, glm::ivec3(indices[a], indices[b], indices[c]), vertices);
     }
   }
 }
 
-static void HeightmapToPLY(const Heightmap &hm,
-                           const Scale &scale) {
+// Trace the base to go under the surface, once the mask has been filled in.
+static MergedBase MergeBase(const PixelMask &mask) {
+  auto t0 = std::chrono::steady_clock::now();
+  MergedBase base = TraceMergedBase(mask);
+  auto t1 = std::chrono::steady_clock::now();
+  fprintf(stderr, "Traced base in %.2f s\n", std::chrono::duration<double>(t1-t0).count());
+  fprintf(stderr, "base has %.2e triangles, walls %.2e, and %.2e vertices\n",
+          (double)base.triangles.size(), (double)base.wall_triangle_count, (double)base.corners.size());
+  return base;
+}
+
+// Write header.dat, vertices.dat and triangles.dat, to be concatenated into a PLY.
+static void HeightmapToPLYParts(const Heightmap &hm,
+                                const Scale &scale) {
   // Open output files
-  FILE *vertex_output = fopen("vertices.dat", "w");
-  if (vertex_output == NULL) {
+  MeshOutput output{};
+  output.pass = Pass::kWrite;
+  output.vertex_file = fopen("vertices.dat", "w");
+  if (output.vertex_file == NULL) {
     fprintf(stderr, "Error opening vertex output file\n");
     exit(1);
   }
 
-  FILE *triangle_output = fopen("triangles.dat", "w");
-  if (triangle_output == NULL) {
+  output.triangle_file = fopen("triangles.dat", "w");
+  if (output.triangle_file == NULL) {
     fprintf(stderr, "Error opening triangle output file\n");
     exit(1);
   }
 
+  std::unique_ptr<PixelMask> mask;
+  std::vector<std::vector<OutlineVertex> > outline;
+  if (scale.merge_base) {
+    mask = std::make_unique<PixelMask>(hm.width, hm.height);
+    outline.resize(hm.height + 1);
+    output.mask = mask.get();
+    output.outline = &outline;
+  }
+
   // Traverse the heightmap and count the triangles.
-  vertex_map_t vmap;
-  uint32_t triangle_count = 0;
-  auto t0 = std::chrono::steady_clock::now();
-  Mesh(hm, vertex_output, triangle_output, &vmap, &triangle_count, scale);
-  auto t1 = std::chrono::steady_clock::now();
-  fprintf(stderr, "Meshed in %.2f s\n", std::chrono::duration<double>(t1-t0).count());
-  fprintf(stderr, "mesh has %.2e triangles and %.2e vertices\n",
-         (double)triangle_count, (double)vmap.size());
-  fclose(vertex_output);
-  fclose(triangle_output);
+  const TileRect rect = WholeHeightmap(hm);
+  MeshPass(hm, rect, scale, NULL, &output);
+  if (scale.merge_base) {
+    WriteMergedBase(hm, rect, scale, MergeBase(*mask), outline, &output);
+  }
+  fclose(output.vertex_file);
+  fclose(output.triangle_file);
 
   // Open header file
   FILE *header_output = fopen("header.dat", "w");
@@ -381,23 +772,221 @@ static void HeightmapToPLY(const Heightmap &hm,
   }
 
   // Write header.
-  WritePlyHeader(header_output, (uint32_t)vmap.size(), triangle_count);
+  WritePlyHeader(header_output, output.vindex.count, output.triangle_count);
 
   // Close output.
   fclose(header_output);
 }
 
+// Write rect as one PLY file at path, sized by a counting pass before anything is written.
+static void HeightmapToPLY(const Heightmap &hm,
+                           const TileRect &rect,
+                           const Scale &scale,
+                           const char *path) {
+  // The second pass re-reads the rows, so a stream has to be rewindable.
+  if (hm.stream && !hm.stream->Rewind()) {
+    fprintf(stderr, "Can't mesh a heightmap from a pipe twice. Drop -o to write the mesh in parts.\n");
+    exit(1);
+  }
+
+  const uint32_t height = rect.Height();
+  RowCounts counts;
+  counts.vertices.assign(height, 0);
+  counts.triangles.assign(height, 0);
+  counts.first_vertex.assign(height + 1, 0);
+  counts.first_triangle.assign(height + 1, 0);
+
+  std::unique_ptr<PixelMask> mask;
+  std::vector<std::vector<OutlineVertex> > outline;
+  if (scale.merge_base) {
+    mask = std::make_unique<PixelMask>(rect.Width(), height);
+    outline.resize(height + 1);
+  }
+
+  MeshOutput count{};
+  count.pass = Pass::kCountVerticesAndTriangles;
+  count.mask = mask.get();
+  MeshPass(hm, rect, scale, &counts, &count);
+  uint64_t vertex_total = counts.first_vertex[height];
+  uint64_t triangle_total = counts.first_triangle[height];
+
+  MergedBase base;
+  if (scale.merge_base) {
+    base = MergeBase(*mask);
+    vertex_total += base.corners.size();
+    triangle_total += base.triangles.size() + base.wall_triangle_count;
+    if (vertex_total > TRIX_FACE_MAX || triangle_total > TRIX_FACE_MAX) {
+      fprintf(stderr, "Too many vertices or triangles!!!\n");
+      exit(1);
+    }
+  }
+  const uint32_t vertex_count = (uint32_t)vertex_total;
+  const uint32_t triangle_count = (uint32_t)triangle_total;
+
+  if (hm.stream && !hm.stream->Rewind()) {
+    fprintf(stderr, "Failed to rewind the heightmap stream\n");
+    exit(1);
+  }
+
+  PlyWriter writer(path, vertex_count, triangle_count);
+  MeshOutput output{};
+  output.pass = Pass::kWrite;
+  output.writer = &writer;
+  output.vertex_capacity = vertex_count;
+  output.triangle_capacity = triangle_count;
+  if (scale.merge_base) {
+    output.outline = &outline;
+  }
+  MeshPass(hm, rect, scale, &counts, &output);
+  if (scale.merge_base) {
+    // the bands numbered their own copies of output
+    output.vindex.count = (uint32_t)counts.first_vertex[height];
+    output.triangle_count = (uint32_t)counts.first_triangle[height];
+    WriteMergedBase(hm, rect, scale, base, outline, &output);
+  }
+  writer.Close();
+  if (!IsWholeHeightmap(hm, rect)) {
+    fprintf(stderr, "%s has %.2e triangles and %.2e vertices\n", path, (double)triangle_count, (double)vertex_count);
+  }
+}
+
+// Write rect as a binary STL in one pass, each triangle as it's made. Vertices aren't
+// shared in an STL, so nothing needs counting up front and a pipe can be meshed.
+static void HeightmapToSTL(const Heightmap &hm,
+                           const TileRect &rect,
+                           const Scale &scale,
+                           const char *path) {
+  StlWriter stl(path);
+  MeshOutput output{};
+  output.pass = Pass::kWrite;
+  output.stl = &stl;
+
+  std::unique_ptr<PixelMask> mask;
+  std::vector<std::vector<OutlineVertex> > outline;
+  if (scale.merge_base) {
+    mask = std::make_unique<PixelMask>(rect.Width(), rect.Height());
+    outline.resize(rect.Height() + 1);
+    output.mask = mask.get();
+    output.outline = &outline;
+  }
+
+  MeshPass(hm, rect, scale, NULL, &output);
+  if (scale.merge_base) {
+    WriteMergedBase(hm, rect, scale, MergeBase(*mask), outline, &output);
+  }
+  stl.Close();
+  if (!IsWholeHeightmap(hm, rect)) {
+    fprintf(stderr, "%s has %.2e triangles\n", path, (double)stl.TriangleCount());
+  }
+}
+
+// Where path's extension starts, or its end if it has none.
+static size_t ExtensionStart(const std::string &path) {
+  const size_t slash = path.find_last_of('/');
+  const size_t dot = path.find_last_of('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    return path.size();
+  }
+  return dot;
+}
+
+// Cut the heightmap into a grid of tiles, each meshed into a file of its own named
+// after path, grid.ply becoming grid_<column>_<row>.ply, and list them in a manifest
+// next to it:
+//
+//   mesh_tiles 1
+//   # path x0 y0 width height
+//   grid_0_0.ply 0 0 2000 1500
+//
+// Paths are relative to the manifest and rectangles are in heightmap pixels. Each
+// tile has its own walls and base, and the surface vertices along a seam are the
+// same in the tiles either side of it, so the tiles fit back together exactly.
+static void HeightmapToTiles(const Heightmap &hm,
+                             const Scale &scale,
+                             const Settings &config) {
+  if (hm.data == NULL) {
+    fprintf(stderr, "Tiles are meshed in parallel and need a mapped heightmap.\n");
+    exit(1);
+  }
+  if (config.tile_columns > hm.width || config.tile_rows > hm.height) {
+    fprintf(stderr, "Can't cut a %u x %u heightmap into %u x %u tiles.\n",
+            hm.width, hm.height, config.tile_columns, config.tile_rows);
+    exit(1);
+  }
+
+  const bool stl = config.stl_output != NULL;
+  const std::string path = stl ? config.stl_output : config.output;
+  const size_t extension = ExtensionStart(path);
+  const size_t slash = path.find_last_of('/');
+  const size_t name_start = slash == std::string::npos ? 0 : slash + 1;
+
+  std::vector<TileRect> tiles;
+  std::vector<std::string> paths;
+  for (uint32_t row = 0; row < config.tile_rows; row++) {
+    for (uint32_t column = 0; column < config.tile_columns; column++) {
+      tiles.push_back({(uint32_t)((uint64_t)hm.width * column / config.tile_columns),
+                       (uint32_t)((uint64_t)hm.height * row / config.tile_rows),
+                       (uint32_t)((uint64_t)hm.width * (column + 1) / config.tile_columns),
+                       (uint32_t)((uint64_t)hm.height * (row + 1) / config.tile_rows)});
+      paths.push_back(path.substr(0, extension) + "_" + std::to_string(column) + "_" + std::to_string(row) +
+                      path.substr(extension));
+    }
+  }
+
+  auto t0 = std::chrono::steady_clock::now();
+  ParallelFor(tiles.size(), 1, [&](const uint64_t begin, const uint64_t end) {
+    for (uint64_t k = begin; k < end; k++) {
+      if (stl) {
+        HeightmapToSTL(hm, tiles[k], scale, paths[k].c_str());
+      } else {
+        HeightmapToPLY(hm, tiles[k], scale, paths[k].c_str());
+      }
+    }
+  });
+  auto t1 = std::chrono::steady_clock::now();
+  fprintf(stderr, "Meshed %zu tiles in %.2f s\n", tiles.size(), std::chrono::duration<double>(t1-t0).count());
+
+  const std::string manifest_path = path.substr(0, extension) + ".tiles";
+  FILE *manifest = fopen(manifest_path.c_str(), "w");
+  if (manifest == NULL) {
+    fprintf(stderr, "Error opening tile manifest %s\n", manifest_path.c_str());
+    exit(1);
+  }
+  fprintf(manifest, "mesh_tiles 1\n");
+  fprintf(manifest, "# path x0 y0 width height\n");
+  for (size_t k = 0; k < tiles.size(); k++) {
+    fprintf(manifest, "%s %u %u %u %u\n", paths[k].c_str() + name_start,
+            tiles[k].x0, tiles[k].y0, tiles[k].Width(), tiles[k].Height());
+  }
+  fclose(manifest);
+}
 
 int32_t main(int32_t argc, char **argv) {
   const Settings config = ParseArgs(argc, argv);
   Heightmap hm{};
   auto t0 = std::chrono::steady_clock::now();
-  ReadHeightmap(config.input, &hm);
+  if (config.stream) {
+    StreamHeightmap(config.input, !config.has_range, &hm);
+  } else {
+    ReadHeightmap(config.input, config.level, config.window, &hm);
+  }
+  if (config.has_range) {
+    hm.min = config.range_min;
+    hm.max = config.range_max;
+  }
   DumpHeightmap(hm);
   auto t1 = std::chrono::steady_clock::now();
   fprintf(stderr, "Read heightmap in %.2f s\n", std::chrono::duration<double>(t1-t0).count());
   const Scale scale = ComputeScale(config, hm);
-  HeightmapToPLY(hm, scale);
+  if (config.tile_columns > 1 || config.tile_rows > 1) {
+    HeightmapToTiles(hm, scale, config);
+  } else if (config.stl_output != NULL) {
+    HeightmapToSTL(hm, WholeHeightmap(hm), scale, config.stl_output);
+  } else if (config.output != NULL) {
+    HeightmapToPLY(hm, WholeHeightmap(hm), scale, config.output);
+  } else {
+    HeightmapToPLYParts(hm, scale);
+  }
 
   return 0;
 }
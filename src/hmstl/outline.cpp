@@ -0,0 +1,497 @@
+#include "outline.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include <finish_mesh/earcut.hpp>
+#include "src/common/parallel.hpp"
+
+PixelMask::PixelMask(const uint32_t width, const uint32_t height) :
+    width_(width),
+    height_(height),
+    words_per_row_(((uint64_t)width + 63) / 64),
+    bits_(words_per_row_ * height, 0) {
+}
+
+void PixelMask::SetRow(const uint32_t y, const float *row) {
+  uint64_t *bits = &bits_[y * words_per_row_];
+  for (uint64_t w = 0; w < words_per_row_; w++) {
+    const uint32_t x0 = (uint32_t)(w * 64);
+    const uint32_t x1 = std::min(width_, x0 + 64);
+    uint64_t word = 0;
+    for (uint32_t x = x0; x < x1; x++) {
+      if (!std::isnan(row[x])) {
+        word |= uint64_t{1} << (x - x0);
+      }
+    }
+    bits[w] = word;
+  }
+}
+
+uint32_t PixelMask::Find(const uint32_t y, const uint32_t x0, const bool value) const {
+  const uint64_t *row = Row(y);
+  uint64_t x = x0;
+  while (x < width_) {
+    uint64_t word = value ? row[x / 64] : ~row[x / 64];
+    word &= ~uint64_t{0} << (x % 64);
+    if (word != 0) {
+      // bits past the width are clear, so a search for clear bits stops at width_
+      return (uint32_t)std::min<uint64_t>(width_, (x & ~uint64_t{63}) + (uint64_t)__builtin_ctzll(word));
+    }
+    x = (x & ~uint64_t{63}) + 64;
+  }
+  return width_;
+}
+
+glm::ivec2 HeadingStep(const Heading heading) {
+  switch (heading) {
+  case Heading::kEast:
+    return {1, 0};
+  case Heading::kSouth:
+    return {0, 1};
+  case Heading::kWest:
+    return {-1, 0};
+  case Heading::kNorth:
+    return {0, -1};
+  default:
+    return {0, 0};
+  }
+}
+
+// A pixel, or a corner of the lattice between them.
+struct LatticePoint {
+  int64_t x;
+  int64_t y;
+};
+
+static inline Heading Turn(const Heading heading, const int quarters) {
+  return (Heading)(((int)heading + quarters) % 4);
+}
+
+// The pixel on the right of the edge leaving corner (cx, line) along heading, which
+// is the unmasked one if the edge is on the outline. The one on the left is masked.
+static inline LatticePoint RightPixel(const int64_t cx, const int64_t line, const Heading heading) {
+  switch (heading) {
+  case Heading::kEast:
+    return {cx, line};
+  case Heading::kSouth:
+    return {cx - 1, line};
+  case Heading::kWest:
+    return {cx - 1, line - 1};
+  case Heading::kNorth:
+    return {cx, line - 1};
+  default:
+    return {0, 0};
+  }
+}
+
+static inline LatticePoint LeftPixel(const int64_t cx, const int64_t line, const Heading heading) {
+  switch (heading) {
+  case Heading::kEast:
+    return {cx, line - 1};
+  case Heading::kSouth:
+    return {cx, line};
+  case Heading::kWest:
+    return {cx - 1, line};
+  case Heading::kNorth:
+    return {cx - 1, line - 1};
+  default:
+    return {0, 0};
+  }
+}
+
+static inline bool IsOutlineEdge(const PixelMask &mask, const int64_t cx, const int64_t line, const Heading heading) {
+  const LatticePoint right = RightPixel(cx, line, heading);
+  const LatticePoint left = LeftPixel(cx, line, heading);
+  return mask.Get(right.x, right.y) && !mask.Get(left.x, left.y);
+}
+
+// Which outline edges have been walked. Horizontal edge cx of a line runs from
+// corner cx to cx + 1, vertical edge cx of a row from line y to y + 1.
+struct WalkedEdges {
+  uint64_t width;
+  std::vector<bool> horizontal;
+  std::vector<bool> vertical;
+
+  std::vector<bool>::reference At(const uint32_t cx, const uint32_t line, const Heading heading) {
+    switch (heading) {
+    case Heading::kEast:
+      return horizontal[line * width + cx];
+    case Heading::kWest:
+      return horizontal[line * width + cx - 1];
+    case Heading::kSouth:
+      return vertical[line * (width + 1) + cx];
+    case Heading::kNorth:
+      return vertical[(line - 1) * (width + 1) + cx];
+    default:
+      return horizontal[0];
+    }
+  }
+};
+
+// A closed loop of outline, runs [first_run, first_run + num_runs).
+struct Loop {
+  uint64_t first_run;
+  uint64_t num_runs;
+  // positive (in image coordinates) around a region, negative around a hole
+  int64_t twice_area;
+  // union-find root of the region it bounds
+  uint64_t region;
+};
+
+// Walk the loop through edge (cx, line, heading), keeping the unmasked pixel on the
+// right. Where two regions touch diagonally there are two ways on, and turning
+// right first keeps to the pixel being followed, so regions only join along an edge.
+static void WalkLoop(const PixelMask &mask,
+                     uint32_t cx,
+                     uint32_t line,
+                     Heading heading,
+                     WalkedEdges *walked,
+                     std::vector<OutlineRun> *runs) {
+  const uint64_t first_run = runs->size();
+  OutlineRun run = {cx, line, 0, heading};
+  while (true) {
+    walked->At(cx, line, heading) = true;
+    run.length++;
+    const glm::ivec2 step = HeadingStep(heading);
+    cx = (uint32_t)((int64_t)cx + step.x);
+    line = (uint32_t)((int64_t)line + step.y);
+
+    Heading next = heading;
+    for (const int quarters : {1, 0, 3}) {
+      next = Turn(heading, quarters);
+      if (IsOutlineEdge(mask, cx, line, next)) {
+        break;
+      }
+    }
+    if (walked->At(cx, line, next)) {
+      // back at the first edge
+      break;
+    }
+    if (next != heading) {
+      runs->push_back(run);
+      run = {cx, line, 0, next};
+      heading = next;
+    }
+  }
+
+  // The first edge may have been part way along a run, in which case the last
+  // run carries on into it.
+  if (runs->size() > first_run && (*runs)[first_run].heading == run.heading) {
+    run.length += (*runs)[first_run].length;
+    (*runs)[first_run] = run;
+  } else {
+    runs->push_back(run);
+  }
+}
+
+// Horizontal spans of unmasked pixels, grouped into 4-connected regions.
+class Regions {
+public:
+  explicit Regions(const PixelMask &mask) : row_first_span_(mask.Height() + 1, 0) {
+    for (uint32_t y = 0; y < mask.Height(); y++) {
+      row_first_span_[y] = spans_.size();
+      uint32_t x0 = mask.Find(y, 0, true);
+      while (x0 < mask.Width()) {
+        const uint32_t x1 = mask.Find(y, x0, false);
+        spans_.push_back({x0, x1});
+        x0 = mask.Find(y, x1, true);
+      }
+    }
+    row_first_span_[mask.Height()] = spans_.size();
+
+    parent_.resize(spans_.size());
+    for (uint64_t k = 0; k < parent_.size(); k++) {
+      parent_[k] = k;
+    }
+    // join spans that overlap the row above
+    for (uint32_t y = 1; y < mask.Height(); y++) {
+      uint64_t above = row_first_span_[y - 1];
+      uint64_t below = row_first_span_[y];
+      while (above < row_first_span_[y] && below < row_first_span_[y + 1]) {
+        if (spans_[above].x0 < spans_[below].x1 && spans_[below].x0 < spans_[above].x1) {
+          Join(above, below);
+        }
+        if (spans_[above].x1 < spans_[below].x1) {
+          above++;
+        } else {
+          below++;
+        }
+      }
+    }
+  }
+
+  // Region of unmasked pixel (x, y).
+  uint64_t Of(const uint32_t x, const uint32_t y) {
+    const Span *first = spans_.data() + row_first_span_[y];
+    const Span *last = spans_.data() + row_first_span_[y + 1];
+    const Span *span = std::upper_bound(first, last, x, [](const uint32_t v, const Span &s) { return v < s.x0; }) - 1;
+    return Root((uint64_t)(span - spans_.data()));
+  }
+
+private:
+  struct Span {
+    uint32_t x0;
+    uint32_t x1;
+  };
+
+  uint64_t Root(uint64_t k) {
+    while (parent_[k] != k) {
+      parent_[k] = parent_[parent_[k]];
+      k = parent_[k];
+    }
+    return k;
+  }
+
+  void Join(const uint64_t a, const uint64_t b) {
+    const uint64_t ra = Root(a);
+    const uint64_t rb = Root(b);
+    if (ra != rb) {
+      parent_[std::max(ra, rb)] = std::min(ra, rb);
+    }
+  }
+
+  std::vector<Span> spans_;
+  std::vector<uint64_t> row_first_span_;
+  std::vector<uint64_t> parent_;
+};
+
+static inline uint64_t CornerId(const uint64_t width, const OutlineRun &run) {
+  return run.line * (width + 1) + run.cx;
+}
+
+static inline LatticePoint Corner(const uint64_t width, const uint64_t id) {
+  return {(int64_t)(id % (width + 1)), (int64_t)(id / (width + 1))};
+}
+
+// Find a base corner strictly between corners a and b, if they're on the same line
+// or column, and put it in middle. corners is sorted by line and columns by column.
+static bool CornerBetween(const uint64_t width,
+                          const uint64_t height,
+                          const std::vector<uint64_t> &corners,
+                          const std::vector<uint64_t> &columns,
+                          const uint64_t a,
+                          const uint64_t b,
+                          uint64_t *middle) {
+  const LatticePoint pa = Corner(width, a);
+  const LatticePoint pb = Corner(width, b);
+  if (pa.y == pb.y) {
+    const uint64_t lo = std::min(a, b);
+    const uint64_t hi = std::max(a, b);
+    const auto found = std::upper_bound(corners.begin(), corners.end(), lo);
+    if (found != corners.end() && *found < hi) {
+      *middle = *found;
+      return true;
+    }
+  } else if (pa.x == pb.x) {
+    const uint64_t lo = (uint64_t)pa.x * (height + 1) + (uint64_t)std::min(pa.y, pb.y);
+    const uint64_t hi = (uint64_t)pa.x * (height + 1) + (uint64_t)std::max(pa.y, pb.y);
+    const auto found = std::upper_bound(columns.begin(), columns.end(), lo);
+    if (found != columns.end() && *found < hi) {
+      *middle = (*found % (height + 1)) * (width + 1) + (uint64_t)pa.x;
+      return true;
+    }
+  }
+  return false;
+}
+
+MergedBase TraceMergedBase(const PixelMask &mask) {
+  const uint32_t width = mask.Width();
+  const uint32_t height = mask.Height();
+  MergedBase base;
+
+  // Walk every loop, starting each from its first horizontal edge in scan order.
+  // An edge on line y is on the outline when exactly one of the pixels either side is unmasked.
+  WalkedEdges walked;
+  walked.width = width;
+  walked.horizontal.assign((uint64_t)width * (height + 1), false);
+  walked.vertical.assign((uint64_t)(width + 1) * height, false);
+  std::vector<Loop> loops;
+  const std::vector<uint64_t> empty(mask.WordsPerRow(), 0);
+  for (uint32_t line = 0; line <= height; line++) {
+    const uint64_t *above = line == 0 ? empty.data() : mask.Row(line - 1);
+    const uint64_t *below = line == height ? empty.data() : mask.Row(line);
+    for (uint64_t w = 0; w < mask.WordsPerRow(); w++) {
+      uint64_t edges = above[w] ^ below[w];
+      while (edges != 0) {
+        const uint32_t cx = (uint32_t)(w * 64 + (uint64_t)__builtin_ctzll(edges));
+        edges &= edges - 1;
+        if (walked.horizontal[line * (uint64_t)width + cx]) {
+          continue;
+        }
+        Loop loop;
+        loop.first_run = base.runs.size();
+        if (mask.Get(cx, line)) {
+          WalkLoop(mask, cx, line, Heading::kEast, &walked, &base.runs);
+        } else {
+          WalkLoop(mask, cx + 1, line, Heading::kWest, &walked, &base.runs);
+        }
+        loop.num_runs = base.runs.size() - loop.first_run;
+        loops.push_back(loop);
+      }
+    }
+  }
+
+  // Every loop goes clockwise around the unmasked pixels on its right, so it's
+  // the outside of a region if it encloses them and a hole in one if it doesn't.
+  Regions regions(mask);
+  for (Loop &loop : loops) {
+    loop.twice_area = 0;
+    for (uint64_t k = 0; k < loop.num_runs; k++) {
+      const OutlineRun &a = base.runs[loop.first_run + k];
+      const OutlineRun &b = base.runs[loop.first_run + (k + 1) % loop.num_runs];
+      loop.twice_area += (int64_t)a.cx * (int64_t)b.line - (int64_t)b.cx * (int64_t)a.line;
+    }
+    const OutlineRun &first = base.runs[loop.first_run];
+    const LatticePoint pixel = RightPixel(first.cx, first.line, first.heading);
+    loop.region = regions.Of((uint32_t)pixel.x, (uint32_t)pixel.y);
+  }
+
+  // Base vertices go where the outline turns.
+  base.wall_triangle_count = 0;
+  for (const OutlineRun &run : base.runs) {
+    base.corners.push_back(CornerId(width, run));
+    base.wall_triangle_count += run.length + 1;
+  }
+  std::sort(base.corners.begin(), base.corners.end());
+  base.corners.erase(std::unique(base.corners.begin(), base.corners.end()), base.corners.end());
+
+  // The same corners sorted by column, cx * (height + 1) + line.
+  std::vector<uint64_t> columns;
+  columns.reserve(base.corners.size());
+  for (const uint64_t corner : base.corners) {
+    const LatticePoint p = Corner(width, corner);
+    columns.push_back((uint64_t)p.x * (height + 1) + (uint64_t)p.y);
+  }
+  std::sort(columns.begin(), columns.end());
+
+  // Group the loops by region, the outside of each first and then its holes.
+  std::vector<uint64_t> order(loops.size());
+  for (uint64_t k = 0; k < order.size(); k++) {
+    order[k] = k;
+  }
+  std::stable_sort(order.begin(), order.end(), [&loops](const uint64_t a, const uint64_t b) {
+    if (loops[a].region != loops[b].region) {
+      return loops[a].region < loops[b].region;
+    }
+    return loops[a].twice_area > 0 && loops[b].twice_area < 0;
+  });
+  std::vector<uint64_t> region_first_loop;
+  for (uint64_t k = 0; k < order.size(); k++) {
+    if (k == 0 || loops[order[k]].region != loops[order[k - 1]].region) {
+      if (loops[order[k]].twice_area <= 0) {
+        fprintf(stderr, "Error: outline region %" PRIu64 " has no outside loop\n", loops[order[k]].region);
+        exit(1);
+      }
+      region_first_loop.push_back(k);
+    }
+  }
+  region_first_loop.push_back(order.size());
+
+  // Triangulate the regions, in lattice coordinates which are exact.
+  const uint64_t num_regions = region_first_loop.size() - 1;
+  std::vector<std::vector<glm::ivec3> > region_triangles(num_regions);
+  ParallelFor(num_regions, 1, [&](const uint64_t begin, const uint64_t end) {
+    for (uint64_t r = begin; r < end; r++) {
+      std::vector<std::vector<std::array<double, 2> > > polygon;
+      std::vector<uint64_t> corner_ids;
+      for (uint64_t k = region_first_loop[r]; k < region_first_loop[r + 1]; k++) {
+        const Loop &loop = loops[order[k]];
+        polygon.emplace_back();
+        for (uint64_t j = loop.first_run; j < loop.first_run + loop.num_runs; j++) {
+          const OutlineRun &run = base.runs[j];
+          polygon.back().push_back({(double)run.cx, (double)run.line});
+          corner_ids.push_back(CornerId(width, run));
+        }
+      }
+
+      const std::vector<uint32_t> indices = mapbox::earcut<uint32_t>(polygon);
+      std::vector<std::array<uint64_t, 3> > pending;
+      for (uint64_t k = 0; k + 2 < indices.size(); k += 3) {
+        std::array<uint64_t, 3> triangle;
+        for (uint64_t j = 0; j < 3; j++) {
+          triangle[j] = corner_ids[indices[k + j]];
+        }
+        // Clockwise seen from above, like hmply's per pixel bottom, is
+        // counterclockwise in image coordinates.
+        const LatticePoint p0 = Corner(width, triangle[0]);
+        const LatticePoint p1 = Corner(width, triangle[1]);
+        const LatticePoint p2 = Corner(width, triangle[2]);
+        if ((p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x) < 0) {
+          std::swap(triangle[1], triangle[2]);
+        }
+        pending.push_back(triangle);
+      }
+
+      // Earcut drops vertices in the middle of straight edges, but the walls need
+      // every turn of the outline in the base. Split triangles at any they pass by.
+      while (!pending.empty()) {
+        const std::array<uint64_t, 3> triangle = pending.back();
+        pending.pop_back();
+        bool split = false;
+        for (uint64_t e = 0; e < 3 && !split; e++) {
+          const uint64_t a = triangle[e];
+          const uint64_t b = triangle[(e + 1) % 3];
+          const uint64_t c = triangle[(e + 2) % 3];
+          uint64_t middle;
+          if (CornerBetween(width, height, base.corners, columns, a, b, &middle)) {
+            pending.push_back({a, middle, c});
+            pending.push_back({middle, b, c});
+            split = true;
+          }
+        }
+        if (!split) {
+          glm::ivec3 face;
+          for (int j = 0; j < 3; j++) {
+            face[j] = (int)(std::lower_bound(base.corners.begin(), base.corners.end(), triangle[(uint64_t)j]) -
+                            base.corners.begin());
+          }
+          region_triangles[r].push_back(face);
+        }
+      }
+    }
+  });
+  for (const std::vector<glm::ivec3> &triangles : region_triangles) {
+    base.triangles.insert(base.triangles.end(), triangles.begin(), triangles.end());
+  }
+
+  return base;
+}
+
+// The wall is a polygon over a straight bottom edge, monotone along the run, so it's
+// triangulated by sweeping along the top: a vertex whose predecessor is above the line
+// to the one before closes off that triangle, and whatever is left at the end is
+// fanned to the far bottom corner.
+void TriangulateWall(const float *z, const uint32_t n, std::vector<glm::ivec3> *triangles) {
+  const int bottom_start = (int)n + 1;
+  const int bottom_end = (int)n + 2;
+  // position of vertex k along the run and up the wall
+  const auto s = [n, bottom_start, bottom_end](const int k) {
+    return k == bottom_start ? 0.0f : k == bottom_end ? (float)n : (float)k;
+  };
+  const auto h = [z, n](const int k) {
+    return k > (int)n ? 0.0f : z[k];
+  };
+
+  // Triangles are clockwise looking at the wall from outside, with the run going left to right.
+  std::vector<int> chain = {bottom_start, 0};
+  for (int k = 1; k <= (int)n; k++) {
+    while (chain.size() >= 2) {
+      const int a = chain[chain.size() - 2];
+      const int b = chain.back();
+      const float cross = (s(b) - s(a)) * (h(k) - h(a)) - (h(b) - h(a)) * (s(k) - s(a));
+      if (!(cross < 0)) {
+        break;
+      }
+      triangles->push_back({a, b, k});
+      chain.pop_back();
+    }
+    chain.push_back(k);
+  }
+  for (uint64_t k = 0; k + 1 < chain.size(); k++) {
+    triangles->push_back({chain[k], chain[k + 1], bottom_end});
+  }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <inttypes.h>
+#include <vector>
+#include <glm/glm.hpp>
+
+// One bit per pixel, set where the heightmap isn't masked. Each row starts on a
+// new word, so bands of rows can be filled in from different threads.
+class PixelMask {
+public:
+  PixelMask(const uint32_t width, const uint32_t height);
+
+  uint32_t Width() const { return width_; }
+  uint32_t Height() const { return height_; }
+
+  // Set row y from heightmap samples, NaN being masked.
+  void SetRow(const uint32_t y, const float *row);
+
+  // False for masked pixels and for anything outside the heightmap.
+  bool Get(const int64_t x, const int64_t y) const {
+    if (x < 0 || y < 0 || x >= (int64_t)width_ || y >= (int64_t)height_) {
+      return false;
+    }
+    return (Row((uint32_t)y)[x / 64] >> (x % 64)) & 1;
+  }
+
+  const uint64_t *Row(const uint32_t y) const { return &bits_[y * words_per_row_]; }
+  uint64_t WordsPerRow() const { return words_per_row_; }
+
+  // First x >= x0 in row y whose bit is value, or Width() if there's none.
+  uint32_t Find(const uint32_t y, const uint32_t x0, const bool value) const;
+
+private:
+  uint32_t width_;
+  uint32_t height_;
+  uint64_t words_per_row_;
+  std::vector<uint64_t> bits_;
+};
+
+// Directions along the pixel lattice, clockwise in image coordinates (y down).
+enum class Heading : uint8_t {
+  kEast,
+  kSouth,
+  kWest,
+  kNorth
+};
+
+// Lattice step taken by one unit of heading.
+glm::ivec2 HeadingStep(const Heading heading);
+
+// A straight stretch of outline: length unit steps from corner (cx, line) with the
+// unmasked pixels on the right. Corners are numbered as in hmply, corner cx of line
+// y being the top left corner of pixel (cx, y).
+struct OutlineRun {
+  uint32_t cx;
+  uint32_t line;
+  uint32_t length;
+  Heading heading;
+};
+
+// Flat base under a masked heightmap: each 4-connected region of unmasked pixels
+// becomes one polygon, holes and all, instead of two triangles per pixel, and the
+// walls around it are made a straight run at a time.
+struct MergedBase {
+  // lattice corners (line * (width + 1) + cx) where the outline turns, sorted.
+  // These are the only base vertices.
+  std::vector<uint64_t> corners;
+  // bottom triangles, as indices into corners, wound to face down
+  std::vector<glm::ivec3> triangles;
+  // outline of every region and hole, each loop starting at a turn
+  std::vector<OutlineRun> runs;
+  // triangles TriangulateWall makes for all the runs
+  uint64_t wall_triangle_count;
+};
+
+MergedBase TraceMergedBase(const PixelMask &mask);
+
+// Triangulate the wall under a run of n steps. Top vertices 0 to n have heights
+// z[0] to z[n], and vertices n + 1 and n + 2 are the base corners under 0 and n.
+// Appends the n + 1 triangles, wound to face out like hmply's per pixel walls.
+void TriangulateWall(const float *z, const uint32_t n, std::vector<glm::ivec3> *triangles);
@@ -14,7 +14,25 @@ Settings ParseArgs(int32_t argc, char **argv) {
     1.0,  // no x scaling (use raw heightmap values)
     1.0,  // no y scaling (use raw heightmap values)
     1.0,  // no z scaling (use raw heightmap values)
-    0.01f  // base thickness fraction
+    0.01f,  // base thickness fraction
+    false, // map the whole heightmap
+    false, // scan the heightmap for its range
+    0.0,
+    0.0,
+    0,    // full resolution
+    kWholeHeightmap,
+    NULL, // write the mesh in three parts
+    false, // walls and bottom per pixel
+    NULL, // no STL
+    1,    // one tile
+    1
+  };
+
+  // options with no short form
+  static const struct option long_options[] = {
+    {"stl", required_argument, NULL, 'T'},
+    {"tiles", required_argument, NULL, 'G'},
+    {NULL, 0, NULL, 0}
   };
 
   int32_t c;
@@ -22,7 +40,7 @@ Settings ParseArgs(int32_t argc, char **argv) {
   // suppress automatic error messages generated by getopt
   opterr = 0;
 
-  while ((c = getopt(argc, argv, "ax:y:e:z:b:i:m:t:rhs")) != -1) {
+  while ((c = getopt_long(argc, argv, "ax:y:e:z:b:i:o:m:t:r:l:w:d:hsSc", long_options, NULL)) != -1) {
     switch (c) {
     case 'x':
       // x scale
@@ -63,10 +81,64 @@ Settings ParseArgs(int32_t argc, char **argv) {
       // Input file (default stdin)
       config.input = optarg;
       break;
+    case 'o':
+      // Output PLY (default header.dat, vertices.dat and triangles.dat)
+      config.output = optarg;
+      break;
+    case 'T':
+      // Output binary STL (--stl), written triangle by triangle
+      config.stl_output = optarg;
+      break;
+    case 'G':
+      // tile grid COLSxROWS (--tiles), each tile written to its own file
+      if (sscanf(optarg, "%10ux%10u", &config.tile_columns, &config.tile_rows) != 2 ||
+          config.tile_columns < 1 || config.tile_rows < 1) {
+        fprintf(stderr, "Tiles must be COLSxROWS with at least one of each.\n");
+        exit(1);
+      }
+      break;
     case 's':
       // surface only mode - omit base (walls and bottom)
       config.generate_base = false;
       break;
+    case 'c':
+      // merged base mode - bottom as one polygon per region, walls per straight run
+      config.merge_base = true;
+      break;
+    case 'S':
+      // streaming mode - keep only a band of rows in memory
+      config.stream = true;
+      break;
+    case 'r':
+      // height range MIN:MAX (default: scan the heightmap)
+      if (sscanf(optarg, "%20f:%20f", &config.range_min, &config.range_max) != 2 ||
+          config.range_min > config.range_max) {
+        fprintf(stderr, "Range must be MIN:MAX with MIN <= MAX.\n");
+        exit(1);
+      }
+      config.has_range = true;
+      break;
+    case 'w':
+      // window X0,Y0,WIDTH,HEIGHT in pixels (default whole heightmap), shifted down to 0
+      if (!ParseHeightmapWindow(optarg, &config.window)) {
+        fprintf(stderr, "Window must be X0,Y0,WIDTH,HEIGHT with non-negative X0 and Y0.\n");
+        exit(1);
+      }
+      break;
+    case 'd':
+      // box filter decimation factor (default 1)
+      if (sscanf(optarg, "%10d", &config.window.decimation) != 1 || config.window.decimation < 1) {
+        fprintf(stderr, "Decimation must be an integer of at least 1.\n");
+        exit(1);
+      }
+      break;
+    case 'l':
+      // pyramid level (default 0, needs a sidecar from build_pyramid otherwise)
+      if (sscanf(optarg, "%10u", &config.level) != 1) {
+        fprintf(stderr, "Level must be a non-negative integer.\n");
+        exit(1);
+      }
+      break;
     case '?':
       // unrecognized option OR missing option argument
       switch (optopt) {
@@ -76,10 +148,21 @@ Settings ParseArgs(int32_t argc, char **argv) {
       case 'z':
       case 'b':
       case 'i':
+      case 'o':
       case 'm':
       case 't':
+      case 'r':
+      case 'w':
+      case 'd':
+      case 'l':
         fprintf(stderr, "Option -%c requires an argument.\n", optopt);
         break;
+      case 'T':
+        fprintf(stderr, "Option --stl requires an argument.\n");
+        break;
+      case 'G':
+        fprintf(stderr, "Option --tiles requires an argument.\n");
+        break;
       default:
         if (isprint(optopt)) {
           fprintf(stderr, "Unknown option -%c\n", optopt);
@@ -107,9 +190,35 @@ Settings ParseArgs(int32_t argc, char **argv) {
     exit(1);
   }
 
+  if (config.output != NULL && config.stl_output != NULL) {
+    fprintf(stderr, "Give either -o or --stl, not both.\n");
+    exit(1);
+  }
+
+  // stdin can't be mapped, so it's always streamed
   if (config.input == NULL) {
-    fprintf(stderr, "No input path set. Use -i to set input path.\n");
-    std::exit(1);
+    config.stream = true;
+  }
+
+  if (config.level > 0 && config.stream) {
+    fprintf(stderr, "Pyramid levels are mapped from their sidecar and can't be streamed.\n");
+    exit(1);
+  }
+
+  if (!IsWholeHeightmap(config.window) && config.stream) {
+    fprintf(stderr, "Windowed reads need a mapped heightmap and can't be streamed.\n");
+    exit(1);
+  }
+
+  const bool tiled = config.tile_columns > 1 || config.tile_rows > 1;
+  if (tiled && config.output == NULL && config.stl_output == NULL) {
+    fprintf(stderr, "Tiles are named after the -o or --stl path, so one must be given.\n");
+    exit(1);
+  }
+
+  if (tiled && config.stream) {
+    fprintf(stderr, "Tiles are meshed in parallel from a mapped heightmap and can't be streamed.\n");
+    exit(1);
   }
 
   return config;
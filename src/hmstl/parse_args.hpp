@@ -2,6 +2,8 @@
 
 #include <inttypes.h>
 
+#include "src/common/heightmap_data.hpp"
+
 typedef struct {
   bool generate_base; // boolean; output walls and bottom as well as terrain surface if true
   char *input; // path to input file; use stdin if NULL
@@ -10,6 +12,17 @@ typedef struct {
   float y_scale;
   float z_scale; // scaling factor applied to raw Z values
   float baseheight_frac; // height in fraction of base below lowest terrain (technically, offset is added to scaled Z values)
+  bool stream; // boolean; read the heightmap in row bands instead of mapping it whole
+  bool has_range; // boolean; range_min/range_max were given, so the heightmap needn't be prescanned
+  float range_min;
+  float range_max;
+  uint32_t level; // pyramid level to mesh, 0 for the heightmap itself
+  HeightmapWindow window; // crop and decimation applied while reading
+  char *output; // path to the PLY to write; header.dat, vertices.dat and triangles.dat if NULL
+  bool merge_base; // boolean; one polygon for the bottom and a wall per straight run of outline, instead of per pixel
+  char *stl_output; // path to write a binary STL to instead of a PLY, or NULL
+  uint32_t tile_columns; // with -o or --stl, cut the mesh into a grid of tile_columns by tile_rows files
+  uint32_t tile_rows;
 } Settings;
 
 Settings ParseArgs(int32_t argc, char **argv);
@@ -9,8 +9,6 @@ int main(int argc, char* argv[]) {
   }
   const std::string input_path = argv[1];
   const std::string output_path = argv[2];
-  std::vector<glm::vec3> points;
-  std::vector<glm::ivec3> triangles;
-  LoadPly(input_path, &points, &triangles);
-  SaveBinarySTL(output_path, points, triangles);
+  const PlyView mesh(input_path);
+  SaveBinarySTL(output_path, mesh);
 }
@@ -0,0 +1,17 @@
+#include <iostream>
+#include <vector>
+#include "src/common/stl.hpp"
+#include "src/common/ply.hpp"
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::cerr << "Need exactly 2 arguments, input and output" << std::endl;
+    exit(1);
+  }
+  const std::string input_path = argv[1];
+  const std::string output_path = argv[2];
+  std::vector<glm::vec3> vertices;
+  std::vector<glm::ivec3> triangles;
+  LoadBinarySTL(input_path, &vertices, &triangles);
+  SavePly(output_path, vertices, triangles);
+}
@@ -0,0 +1,22 @@
+#include <iostream>
+#include <string>
+#include "src/common/heightmap_data.hpp"
+#include "src/common/tiled_heightmap.hpp"
+
+// Usage: ./tile_heightmap input.dat output.hmt [tile_size]
+int main(int argc, char* argv[]) {
+  if (argc != 3 && argc != 4) {
+    std::cerr << "Need 2 or 3 arguments: input, output and optional tile size" << std::endl;
+    exit(1);
+  }
+  const std::string input_path = argv[1];
+  const std::string output_path = argv[2];
+  const int tile_size = argc == 4 ? std::stoi(argv[3]) : 256;
+  if (tile_size <= 0) {
+    std::cerr << "Tile size must be positive" << std::endl;
+    exit(1);
+  }
+
+  const HeightmapView view(input_path, HeightmapView::Access::kRandom);
+  WriteTiledHeightmap(output_path, view.Width(), view.Height(), view.Data(), static_cast<uint32_t>(tile_size));
+}
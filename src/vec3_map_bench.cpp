@@ -0,0 +1,128 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <glm/glm.hpp>
+
+#include "src/common/hash.hpp"
+#include "src/common/vec3_map.hpp"
+
+// Vertices of a width x height grid mesh as hmply lays them out: a surface vertex
+// at every pixel corner, at x - 0.5 and y - 0.5 scaled, over a base vertex at z = 0.
+static std::vector<glm::vec3> LatticeVertices(const uint32_t width, const uint32_t height) {
+  const float scale = 170.0f / (float)std::max(width, height);
+  std::vector<glm::vec3> vertices;
+  vertices.reserve(2 * (uint64_t)(width + 1) * (height + 1));
+  for (uint32_t line = 0; line <= height; line++) {
+    for (uint32_t cx = 0; cx <= width; cx++) {
+      const float x = ((float)cx - 0.5f) * scale;
+      const float y = ((float)height - ((float)line - 0.5f)) * scale;
+      const float z = 10.0f + (float)((cx * 7 + line * 13) % 100) * 0.25f;
+      vertices.push_back(glm::vec3(x, y, z));
+      vertices.push_back(glm::vec3(x, y, 0));
+    }
+  }
+  return vertices;
+}
+
+// Fraction of keys whose full hash another key also has.
+template <class Hash>
+static double HashCollisionRate(const std::vector<glm::vec3> &vertices, const Hash &hash) {
+  std::vector<uint64_t> hashes;
+  hashes.reserve(vertices.size());
+  for (const glm::vec3 &v : vertices) {
+    hashes.push_back(hash(v));
+  }
+  std::sort(hashes.begin(), hashes.end());
+  uint64_t colliding = 0;
+  for (uint64_t k = 0; k < hashes.size(); k++) {
+    if ((k > 0 && hashes[k - 1] == hashes[k]) || (k + 1 < hashes.size() && hashes[k + 1] == hashes[k])) {
+      colliding++;
+    }
+  }
+  return (double)colliding / (double)std::max<uint64_t>(hashes.size(), 1);
+}
+
+static double Seconds(const std::chrono::steady_clock::time_point &t0) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// Usage: ./vec3_map_bench [width height]
+//
+// Inserts then looks up every vertex of a grid mesh with std::unordered_map over
+// the std::hash in hash.hpp and with Vec3Map, reporting hash collisions, probe
+// lengths and throughput.
+int main(int argc, char* argv[]) {
+  if (argc != 1 && argc != 3) {
+    std::cerr << "Need 0 or 2 arguments: optional grid width and height" << std::endl;
+    exit(1);
+  }
+  const uint32_t width = argc == 3 ? static_cast<uint32_t>(std::stoul(argv[1])) : 2000;
+  const uint32_t height = argc == 3 ? static_cast<uint32_t>(std::stoul(argv[2])) : 2000;
+  const std::vector<glm::vec3> vertices = LatticeVertices(width, height);
+  const double n = (double)vertices.size();
+  fprintf(stderr, "%zu vertices of a %u x %u grid\n", vertices.size(), width, height);
+
+  {
+    const std::hash<glm::vec3> hash;
+    const double collisions = HashCollisionRate(vertices, [&hash](const glm::vec3 &v) { return hash(v); });
+    std::unordered_map<glm::vec3, uint32_t> map;
+    map.reserve(vertices.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint64_t k = 0; k < vertices.size(); k++) {
+      map[vertices[k]] = (uint32_t)k;
+    }
+    const double insert = Seconds(t0);
+    t0 = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (const glm::vec3 &v : vertices) {
+      sum += map.find(v)->second;
+    }
+    const double find = Seconds(t0);
+    uint64_t max_bucket = 0;
+    uint64_t shared = 0;
+    for (uint64_t b = 0; b < map.bucket_count(); b++) {
+      const uint64_t size = map.bucket_size(b);
+      max_bucket = std::max(max_bucket, size);
+      shared += size > 1 ? size : 0;
+    }
+    fprintf(stderr, "std::unordered_map: hash collisions %.4f, keys in shared buckets %.4f, largest bucket %" PRIu64 "\n",
+            collisions, (double)shared / n, max_bucket);
+    fprintf(stderr, "  insert %.1f ns, find %.1f ns per key (%" PRIu64 ")\n",
+            1e9 * insert / n, 1e9 * find / n, sum);
+  }
+
+  {
+    const double collisions = HashCollisionRate(vertices, [](const glm::vec3 &v) { return Vec3Map<uint32_t>::Hash(v); });
+    Vec3Map<uint32_t> map(vertices.size());
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint64_t k = 0; k < vertices.size(); k++) {
+      map[vertices[k]] = (uint32_t)k;
+    }
+    const double insert = Seconds(t0);
+    t0 = std::chrono::steady_clock::now();
+    uint64_t sum = 0;
+    for (const glm::vec3 &v : vertices) {
+      const uint32_t *value = map.Find(v);
+      if (value == NULL) {
+        std::cerr << "Vec3Map lost a key" << std::endl;
+        exit(1);
+      }
+      sum += *value;
+    }
+    const double find = Seconds(t0);
+    uint64_t probes = 0;
+    uint64_t max_probes = 0;
+    for (const glm::vec3 &v : vertices) {
+      const uint64_t p = map.ProbeGroups(v);
+      probes += p;
+      max_probes = std::max(max_probes, p);
+    }
+    fprintf(stderr, "Vec3Map: hash collisions %.4f, mean probe groups %.3f, most %" PRIu64 ", load %.2f\n",
+            collisions, (double)probes / n, max_probes, n / (double)map.Capacity());
+    fprintf(stderr, "  insert %.1f ns, find %.1f ns per key (%" PRIu64 ")\n",
+            1e9 * insert / n, 1e9 * find / n, sum);
+  }
+}
@@ -0,0 +1,59 @@
+#!/usr/bin/env bash
+set -e
+
+# ./test_heightmap_mosaic.sh hmply input.dat
+input=`readlink -f $2`
+dir=$TEST_TMPDIR
+
+# Cut the input into three overlapping tiles that leave a strip uncovered, and
+# write the heightmap the mosaic should read as: the input, NaN off the tiles.
+mx=$(python3 - $input $dir <<'PY'
+import struct, sys
+src, out = sys.argv[1], sys.argv[2]
+data = open(src, 'rb').read()
+ny, nx = struct.unpack('<ii', data[:8])
+assert nx >= 8 and ny >= 8, 'need at least 8 x 8 samples'
+rows = [data[8 + 4 * nx * y:8 + 4 * nx * (y + 1)] for y in range(ny)]
+mx, my = nx // 2, ny // 2
+# name, x0, y0, x1, y1
+tiles = [
+    ('a.dat', 0, 0, mx + 2, ny),
+    ('b.dat', mx - 1, 0, nx, my + 2),
+    ('c.dat', mx + 3, my, nx, ny),
+]
+with open(out + '/mosaic.txt', 'w') as manifest:
+    manifest.write('heightmap_mosaic 1\n# path x0 y0\n')
+    for name, x0, y0, x1, y1 in tiles:
+        with open(out + '/' + name, 'wb') as f:
+            f.write(struct.pack('<ii', y1 - y0, x1 - x0))
+            for y in range(y0, y1):
+                f.write(rows[y][4 * x0:4 * x1])
+        manifest.write('{} {} {}\n'.format(name, x0, y0))
+nan = struct.pack('<f', float('nan'))
+with open(out + '/expected.dat', 'wb') as f:
+    f.write(struct.pack('<ii', ny, nx))
+    for y in range(ny):
+        covered = [False] * nx
+        for _, x0, y0, x1, y1 in tiles:
+            if y0 <= y < y1:
+                covered[x0:x1] = [True] * (x1 - x0)
+        f.write(b''.join(rows[y][4 * x:4 * x + 4] if c else nan for x, c in enumerate(covered)))
+print(mx)
+PY
+)
+
+# whole raster
+$1 -i $dir/expected.dat -o $dir/expected.ply -b 0.25 -e 170
+$1 -i $dir/mosaic.txt -o $dir/mosaic.ply -b 0.25 -e 170
+diff -q $dir/expected.ply $dir/mosaic.ply
+
+# windows only map the tiles they overlap: one inside the first tile, and one
+# across the overlap of the first two
+check_window() {
+    $1 -i $dir/expected.dat -w $2 -o $dir/expected_window.ply -b 0.25 -e 170
+    $1 -i $dir/mosaic.txt -w $2 -o $dir/mosaic_window.ply -b 0.25 -e 170 2> $dir/mosaic_window.log
+    diff -q $dir/expected_window.ply $dir/mosaic_window.ply
+    grep -q "Mapped $3 of 3 mosaic tiles" $dir/mosaic_window.log
+}
+check_window $1 1,1,4,4 1
+check_window $1 $((mx - 3)),1,6,4 2
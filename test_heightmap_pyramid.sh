@@ -0,0 +1,31 @@
+#!/usr/bin/env bash
+set -e
+
+# ./test_heightmap_pyramid.sh build_pyramid hmply input.dat
+dir=$TEST_TMPDIR
+cp `readlink -f $3` $dir/input.dat
+# down to single pixels, so even small rasters have a level 1
+$1 $dir/input.dat 1
+
+# level 1 is the same NaN-aware 2 x 2 mean as a decimated read of level 0
+$2 -i $dir/input.dat -l 1 -o $dir/level.ply -b 0.25 -e 170
+$2 -i $dir/input.dat -d 2 -o $dir/decimated.ply -b 0.25 -e 170
+diff -q $dir/level.ply $dir/decimated.ply
+
+# a sidecar older than its heightmap is rejected
+touch $dir/input.dat
+if $2 -i $dir/input.dat -l 1 -o $dir/stale.ply -b 0.25 -e 170 2> $dir/stale.log; then
+    echo "stale pyramid was used"
+    exit 1
+fi
+grep -q "is older than" $dir/stale.log
+
+# so is one built from a heightmap of another size
+$1 $dir/input.dat 1
+python3 -c "import struct, sys; open(sys.argv[1], 'wb').write(struct.pack('<ii', 2, 2) + bytes(16))" $dir/input.dat
+touch $dir/input.dat.pyr
+if $2 -i $dir/input.dat -l 1 -o $dir/resized.ply -b 0.25 -e 170 2> $dir/resized.log; then
+    echo "pyramid of another size was used"
+    exit 1
+fi
+grep -q "was built from a" $dir/resized.log
@@ -0,0 +1,16 @@
+#!/usr/bin/env bash
+set -e
+
+input=`readlink -f $3`
+
+# ./ply2stl input.ply output.stl, then ./stl2ply output.stl output.ply
+$1 $input $TEST_TMPDIR/output.stl
+$2 $TEST_TMPDIR/output.stl $TEST_TMPDIR/output.ply
+
+# show sizes for debugging
+du -hs $input
+du -hs $TEST_TMPDIR/output.stl
+du -hs $TEST_TMPDIR/output.ply
+
+# diff input/output
+diff -q $input $TEST_TMPDIR/output.ply
@@ -0,0 +1,23 @@
+#!/usr/bin/env bash
+set -e
+
+# ./test_tiled_heightmap.sh tile_heightmap hmm input.dat [hmply]
+input=`readlink -f $3`
+tiled=$TEST_TMPDIR/input.hmt
+
+$1 $input $tiled
+
+# show sizes for debugging
+du -hs $input
+du -hs $tiled
+
+# meshes of the tiled heightmap must match meshes of the original
+$2 -q -t 100000 --zoffset_fraction 0.25 $input $TEST_TMPDIR/data.ply
+$2 -q -t 100000 --zoffset_fraction 0.25 $tiled $TEST_TMPDIR/tiled.ply
+diff -q $TEST_TMPDIR/data.ply $TEST_TMPDIR/tiled.ply
+
+if [ -n "$4" ]; then
+    $4 -i $input -o $TEST_TMPDIR/data_grid.ply -b 0.25 -e 170
+    $4 -i $tiled -o $TEST_TMPDIR/tiled_grid.ply -b 0.25 -e 170
+    diff -q $TEST_TMPDIR/data_grid.ply $TEST_TMPDIR/tiled_grid.ply
+fi